@@ -0,0 +1,226 @@
+/*
+ * attrib.c - Attribution of misses and evictions to blocks and sets.
+ */
+#include "attrib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define ATTRIB_MIN_TABLE 1024
+
+static inline ull hash_key(ull key) {
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static int table_init(attrib_table_t* table, ull size) {
+    table->slots = malloc(size * sizeof(attrib_entry_t));
+    if (!table->slots) {
+        fprintf(stderr, "allocate attribution table failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for (ull i = 0; i < size; ++i) table->slots[i].key = ATTRIB_EMPTY;
+    table->size = size;
+    table->used = 0;
+    return 0;
+}
+
+/**
+ * Return the counters of key, adding them on first use. NULL if out of memory.
+ */
+static attrib_entry_t* table_get(attrib_table_t* table, ull key) {
+    if (2 * (table->used + 1) > table->size) {
+        attrib_table_t bigger;
+        if (table_init(&bigger, table->size * 2) < 0) return NULL;
+        for (ull i = 0; i < table->size; ++i) {
+            const attrib_entry_t* e = &table->slots[i];
+            if (e->key == ATTRIB_EMPTY) continue;
+            ull j = hash_key(e->key) & (bigger.size - 1);
+            while (bigger.slots[j].key != ATTRIB_EMPTY) j = (j + 1) & (bigger.size - 1);
+            bigger.slots[j] = *e;
+        }
+        bigger.used = table->used;
+        free(table->slots);
+        *table = bigger;
+    }
+    ull mask = table->size - 1;
+    ull i = hash_key(key) & mask;
+    while (table->slots[i].key != ATTRIB_EMPTY && table->slots[i].key != key) i = (i + 1) & mask;
+    attrib_entry_t* e = &table->slots[i];
+    if (e->key == ATTRIB_EMPTY) {
+        *e = (attrib_entry_t){key, 0, 0, 0};
+        table->used++;
+    }
+    return e;
+}
+
+int attrib_create(attrib_t* attrib, int flags, const geometry_t* geometry, FILE* heatmap, ull window) {
+    memset(attrib, 0, sizeof(*attrib));
+    attrib->flags = flags;
+    attrib->block_bits = geometry->block_bits;
+    attrib->nsets = 1ULL << geometry->set_bits;
+    if ((flags & ATTRIB_BLOCKS) && (table_init(&attrib->blocks, ATTRIB_MIN_TABLE) < 0
+        || table_init(&attrib->sets, ATTRIB_MIN_TABLE) < 0)) return -1;
+    if ((flags & ATTRIB_PCS) && table_init(&attrib->pcs, ATTRIB_MIN_TABLE) < 0) return -1;
+    if (!heatmap) return 0;
+
+    attrib->heatmap = heatmap;
+    attrib->window = window;
+    attrib->sets_per_column = attrib->nsets > HEATMAP_COLUMNS ? attrib->nsets / HEATMAP_COLUMNS : 1;
+    attrib->columns = attrib->nsets / attrib->sets_per_column;
+    attrib->row = calloc(attrib->columns, sizeof(ull));
+    if (!attrib->row) {
+        fprintf(stderr, "allocate heatmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+    fprintf(heatmap, "access");
+    for (int c = 0; c < attrib->columns; ++c) {
+        ull first = c * attrib->sets_per_column;
+        if (attrib->sets_per_column == 1) fprintf(heatmap, ",set%llu", first);
+        else fprintf(heatmap, ",set%llu-%llu", first, first + attrib->sets_per_column - 1);
+    }
+    fprintf(heatmap, "\n");
+    return 0;
+}
+
+void attrib_destroy(attrib_t* attrib) {
+    free(attrib->blocks.slots);
+    free(attrib->sets.slots);
+    free(attrib->pcs.slots);
+    free(attrib->row);
+    attrib->blocks.slots = attrib->sets.slots = attrib->pcs.slots = NULL;
+    attrib->row = NULL;
+}
+
+/**
+ * Write the row of the window ending at the current access.
+ */
+static void heatmap_row(attrib_t* attrib) {
+    ull start = (attrib->accesses - 1) / attrib->window * attrib->window;
+    fprintf(attrib->heatmap, "%llu", start);
+    for (int c = 0; c < attrib->columns; ++c) fprintf(attrib->heatmap, ",%llu", attrib->row[c]);
+    fprintf(attrib->heatmap, "\n");
+    memset(attrib->row, 0, attrib->columns * sizeof(ull));
+}
+
+void attrib_record(attrib_t* attrib, ull pc, ull addr, ull set, int hits, bool miss, bool eviction) {
+    attrib->accesses++;
+    if (attrib->flags & ATTRIB_PCS) {
+        attrib_entry_t* p = table_get(&attrib->pcs, pc);
+        if (p) {
+            p->accesses++;
+            p->hits += hits;
+            p->misses += miss;
+            p->evictions += eviction;
+        }
+    }
+    if (!(attrib->flags & ATTRIB_BLOCKS)) return;
+    attrib_entry_t* s = table_get(&attrib->sets, set);
+    if (s) {
+        s->accesses++;
+        s->hits += hits;
+        s->misses += miss;
+        s->evictions += eviction;
+    }
+    if (miss) {
+        attrib_entry_t* b = table_get(&attrib->blocks, addr >> attrib->block_bits);
+        if (b) {
+            b->misses++;
+            b->evictions += eviction;
+        }
+    }
+    if (!attrib->heatmap) return;
+    if (miss) attrib->row[set / attrib->sets_per_column]++;
+    if (attrib->accesses % attrib->window == 0) heatmap_row(attrib);
+}
+
+static int by_misses(const void* a, const void* b) {
+    const attrib_entry_t* x = a;
+    const attrib_entry_t* y = b;
+    if (x->misses != y->misses) return x->misses < y->misses ? 1 : -1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+static int by_evictions(const void* a, const void* b) {
+    const attrib_entry_t* x = a;
+    const attrib_entry_t* y = b;
+    if (x->evictions != y->evictions) return x->evictions < y->evictions ? 1 : -1;
+    return by_misses(a, b);
+}
+
+/**
+ * Pack the used slots of table at its start and sort them.
+ */
+static ull table_sort(attrib_table_t* table, int (*cmp)(const void*, const void*)) {
+    ull n = 0;
+    for (ull i = 0; i < table->size; ++i) {
+        if (table->slots[i].key != ATTRIB_EMPTY) table->slots[n++] = table->slots[i];
+    }
+    qsort(table->slots, n, sizeof(attrib_entry_t), cmp);
+    return n;
+}
+
+void attrib_report(attrib_t* attrib, FILE* out, int top) {
+    if (attrib->heatmap && attrib->accesses % attrib->window) heatmap_row(attrib);
+
+    ull nblocks = table_sort(&attrib->blocks, by_misses);
+    fprintf(out, "top missing blocks (%llu blocks missed)\n", nblocks);
+    fprintf(out, "%18s %8s %10s %10s\n", "block", "set", "misses", "evictions");
+    for (ull i = 0; i < nblocks && i < (ull)top; ++i) {
+        const attrib_entry_t* e = &attrib->blocks.slots[i];
+        fprintf(out, "%18llx %8llu %10llu %10llu\n", e->key << attrib->block_bits,
+            e->key & (attrib->nsets - 1), e->misses, e->evictions);
+    }
+
+    ull nsets = table_sort(&attrib->sets, by_evictions);
+    // sets by evictions in log2 buckets: 0, 1, 2-3, 4-7...
+    ull hist[65] = {0};
+    int last = 0;
+    for (ull i = 0; i < nsets; ++i) {
+        ull ev = attrib->sets.slots[i].evictions;
+        int k = ev ? 64 - __builtin_clzll(ev) : 0;
+        hist[k]++;
+        if (k > last) last = k;
+    }
+    hist[0] += attrib->nsets - nsets;
+    fprintf(out, "\nsets by evictions (%llu of %llu sets used)\n", nsets, attrib->nsets);
+    fprintf(out, "%23s %10s\n", "evictions", "sets");
+    for (int k = 0; k <= last; ++k) {
+        ull lo = k ? 1ULL << (k - 1) : 0;
+        ull hi = k ? (k == 64 ? ~0ULL : (1ULL << k) - 1) : 0;
+        fprintf(out, "%11llu-%-11llu %10llu\n", lo, hi, hist[k]);
+    }
+
+    fprintf(out, "\ntop conflict sets\n");
+    fprintf(out, "%8s %10s %10s %10s\n", "set", "accesses", "misses", "evictions");
+    ull max = nsets ? attrib->sets.slots[0].evictions : 0;
+    for (ull i = 0; i < nsets && i < (ull)top; ++i) {
+        const attrib_entry_t* e = &attrib->sets.slots[i];
+        int bar = max ? (int)(40 * e->evictions / max) : 0;
+        fprintf(out, "%8llu %10llu %10llu %10llu %.*s\n", e->key, e->accesses, e->misses,
+            e->evictions, bar, "########################################");
+    }
+}
+
+void attrib_report_pcs(attrib_t* attrib, FILE* out, int top, bool addr2line) {
+    ull npcs = table_sort(&attrib->pcs, by_misses);
+    if (addr2line) {
+        for (ull i = 0; i < npcs && i < (ull)top; ++i) {
+            if (attrib->pcs.slots[i].key) fprintf(out, "0x%llx\n", attrib->pcs.slots[i].key);
+        }
+        return;
+    }
+    fprintf(out, "top missing instructions (%llu instructions)\n", npcs);
+    fprintf(out, "%18s %10s %10s %10s %10s %8s\n", "pc", "accesses", "hits", "misses",
+        "evictions", "miss-%");
+    for (ull i = 0; i < npcs && i < (ull)top; ++i) {
+        const attrib_entry_t* e = &attrib->pcs.slots[i];
+        char pc[24];
+        if (e->key) snprintf(pc, sizeof(pc), "%llx", e->key);
+        else snprintf(pc, sizeof(pc), "unknown");
+        fprintf(out, "%18s %10llu %10llu %10llu %10llu %7.2f%%\n", pc, e->accesses,
+            e->hits, e->misses, e->evictions, 100.0 * e->misses / e->accesses);
+    }
+}
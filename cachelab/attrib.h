@@ -0,0 +1,92 @@
+/*
+ * attrib.h - Attribution of the misses and evictions of the simulated
+ * cache to block addresses, set indexes and instructions.
+ */
+
+#ifndef CSIM_ATTRIB_H
+#define CSIM_ATTRIB_H
+
+#include <stdio.h>
+#include "cache.h"
+
+#define ATTRIB_TOP 10
+#define ATTRIB_WINDOW 1000
+#define HEATMAP_COLUMNS 1024
+
+typedef struct {
+    ull key; /**< block address >> block bits, set index or PC, ATTRIB_EMPTY if unused */
+    ull accesses;
+    ull hits; /**< of the load and of the store of M apart */
+    ull misses;
+    ull evictions;
+} attrib_entry_t;
+
+#define ATTRIB_EMPTY (~0ULL)
+
+/**
+ * @brief counters per key, open addressing in a power of two table
+ */
+typedef struct {
+    attrib_entry_t* slots;
+    ull size;
+    ull used;
+} attrib_table_t;
+
+/**
+ * What to attribute the accesses to.
+ */
+enum {
+    ATTRIB_BLOCKS = 1, /**< blocks and sets */
+    ATTRIB_PCS = 2, /**< the instruction of the I record before each data access */
+};
+
+/**
+ * @brief per block, per set and per PC counters, and the heatmap being written
+ *
+ * The heatmap has a row per window of accesses and a column per set,
+ * neighbouring sets share a column when there are more than
+ * HEATMAP_COLUMNS of them.
+ */
+typedef struct {
+    int flags;
+    attrib_table_t blocks;
+    attrib_table_t sets;
+    attrib_table_t pcs;
+    int block_bits;
+    ull nsets;
+
+    FILE* heatmap; /**< NULL for none */
+    ull window; /**< accesses per row */
+    ull accesses;
+    ull sets_per_column;
+    int columns;
+    ull* row; /**< misses per column in the current window */
+} attrib_t;
+
+/**
+ * Set up the ATTRIB_* attributions of flags for a cache of geometry,
+ * with a CSV heatmap of the misses per window accesses written to
+ * heatmap unless it is NULL.
+ */
+int attrib_create(attrib_t* attrib, int flags, const geometry_t* geometry, FILE* heatmap, ull window);
+void attrib_destroy(attrib_t* attrib);
+
+/**
+ * Count a data access of addr in set by the instruction at pc (0 when
+ * unknown) which hit hits times and missed and/or evicted a line.
+ */
+void attrib_record(attrib_t* attrib, ull pc, ull addr, ull set, int hits, bool miss, bool eviction);
+
+/**
+ * Print the top blocks by misses, the histogram of the sets by evictions
+ * and the top sets, and finish the heatmap.
+ */
+void attrib_report(attrib_t* attrib, FILE* out, int top);
+
+/**
+ * Print the top instructions by misses, or with addr2line only their
+ * addresses, one per line, ready to be piped into addr2line -e <program>.
+ */
+void attrib_report_pcs(attrib_t* attrib, FILE* out, int top, bool addr2line);
+
+#endif /* CSIM_ATTRIB_H */
@@ -0,0 +1,517 @@
+/*
+ * cache.c - Storage of the simulated cache.
+ */
+#include "cache.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#define NIBBLES_1 0x1111111111111111ULL
+#define NIBBLES_8 0x8888888888888888ULL
+
+long tag_match_scalar(const ull* tags, const uint8_t* valid, ull lines, ull tag) {
+    for (ull i = 0; i < lines; ++i) {
+        if (valid[i] && tags[i] == tag) return i;
+    }
+    return -1;
+}
+
+#ifdef __x86_64__
+
+/**
+ * Check the candidates of a compare mask starting at line base.
+ */
+static inline long first_valid(const uint8_t* valid, ull base, unsigned mask) {
+    while (mask) {
+        unsigned bit = __builtin_ctz(mask);
+        if (valid[base + bit]) return base + bit;
+        mask &= mask - 1;
+    }
+    return -1;
+}
+
+long tag_match_sse2(const ull* tags, const uint8_t* valid, ull lines, ull tag) {
+    __m128i key = _mm_set1_epi64x(tag);
+    ull i = 0;
+    for (; i + 4 <= lines; i += 4) {
+        // SSE2 has no 64-bit compare, a lane matches when both of its halves do
+        __m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + i)), key);
+        __m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(tags + i + 2)), key);
+        a = _mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+        b = _mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+        unsigned mask = _mm_movemask_pd(_mm_castsi128_pd(a))
+            | _mm_movemask_pd(_mm_castsi128_pd(b)) << 2;
+        if (mask) {
+            long line = first_valid(valid, i, mask);
+            if (line >= 0) return line;
+        }
+    }
+    for (; i < lines; ++i) {
+        if (valid[i] && tags[i] == tag) return i;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+long tag_match_avx2(const ull* tags, const uint8_t* valid, ull lines, ull tag) {
+    __m256i key = _mm256_set1_epi64x(tag);
+    ull i = 0;
+    for (; i + 8 <= lines; i += 8) {
+        __m256i a = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + i)), key);
+        __m256i b = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(tags + i + 4)), key);
+        unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(a))
+            | _mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4;
+        if (mask) {
+            long line = first_valid(valid, i, mask);
+            if (line >= 0) return line;
+        }
+    }
+    for (; i < lines; ++i) {
+        if (valid[i] && tags[i] == tag) return i;
+    }
+    return -1;
+}
+
+bool cpu_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+long tag_match_sse2(const ull* tags, const uint8_t* valid, ull lines, ull tag) {
+    return tag_match_scalar(tags, valid, lines, tag);
+}
+
+long tag_match_avx2(const ull* tags, const uint8_t* valid, ull lines, ull tag) {
+    return tag_match_scalar(tags, valid, lines, tag);
+}
+
+bool cpu_has_avx2(void) {
+    return false;
+}
+
+#endif
+
+#define ARENA_CHUNK (1 << 20)
+
+/**
+ * Allocate size bytes from arena, the caller holds arena->lock.
+ */
+static void* arena_bump(arena_t* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    arena_chunk_t* chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(arena_chunk_t) + chunk_size);
+        if (!chunk) return NULL;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void* p = (char*)(chunk + 1) + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static void* arena_alloc(arena_t* arena, size_t size) {
+    pthread_mutex_lock(&arena->lock);
+    void* p = arena_bump(arena, size);
+    pthread_mutex_unlock(&arena->lock);
+    return p;
+}
+
+static void arena_free(arena_t* arena) {
+    while (arena->chunks) {
+        arena_chunk_t* next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+static inline uint16_t* set_state(const cache_t* cache, const set_t* set) {
+    return cache->line_state ? (uint16_t*)(set->tags + cache->state_offset) : NULL;
+}
+
+int createCache(cache_t* cache, const geometry_t* geometry, const cache_opts_t* opts) {
+    if (!cache || !geometry) return -1;
+    cache->nsets = 1ULL << geometry->set_bits;
+    cache->lines = geometry->lines;
+    cache->block_size = 1ULL << geometry->block_bits;
+    cache->set_bits = geometry->set_bits;
+    cache->block_bits = geometry->block_bits;
+    cache->flags = opts ? opts->flags : 0;
+    cache->policy = opts && opts->policy ? opts->policy : find_policy("lru");
+    cache->seed = opts ? opts->seed : 0;
+    cache->sector_bits = opts ? opts->sector_bits : 0;
+    if (cache->sector_bits > 0 && (cache->sector_bits > geometry->block_bits
+        || 1ULL << (geometry->block_bits - cache->sector_bits) > MAX_SECTORS)) {
+        fprintf(stderr, "sectors should be at most the block size and at most %d per line\n",
+            MAX_SECTORS);
+        return -1;
+    }
+    if (cache->lines == 0 || cache->lines > MAX_LINES) {
+        fprintf(stderr, "unsupported number of lines per set: %llu\n", cache->lines);
+        return -1;
+    }
+    const char* why = cache->policy->check ? cache->policy->check(cache->lines) : NULL;
+    if (why) {
+        fprintf(stderr, "%s replacement %s\n", cache->policy->name, why);
+        return -1;
+    }
+    cache->line_state = cache->lines > cache->policy->state_above;
+    cache->state_offset = cache->sector_bits ? 3 * cache->lines : cache->lines;
+    if (cache->lines < 4) {
+        cache->match = tag_match_scalar;
+    } else if (cache->lines >= 8 && cpu_has_avx2()) {
+        cache->match = tag_match_avx2;
+    } else {
+        cache->match = tag_match_sse2;
+    }
+
+    cache->pages = calloc((cache->nsets + SET_PAGE - 1) / SET_PAGE, sizeof(set_t*));
+    if (!cache->pages) {
+        fprintf(stderr, "allocate sets failed: %s\n", strerror(errno));
+        return -2;
+    }
+    cache->arena.chunks = NULL;
+    pthread_mutex_init(&cache->arena.lock, NULL);
+    return 0;
+}
+
+void destroyCache(cache_t* cache) {
+    if (!cache) return;
+    if (!cache->pages) return;
+    arena_free(&cache->arena);
+    pthread_mutex_destroy(&cache->arena.lock);
+    free(cache->pages);
+    cache->pages = NULL;
+}
+
+/**
+ * Allocate the tags, sector masks, ages, valid flags and data of a set in
+ * one piece.
+ */
+static int materialize_set(cache_t* cache, set_t* set, ull index) {
+    ull lines = cache->lines;
+    ull states = cache->line_state ? lines : 0;
+    ull data = cache->flags & CACHE_STORE_DATA ? lines * cache->block_size : 0;
+    ull head = cache->state_offset * sizeof(ull);
+    char* meta = arena_alloc(&cache->arena, head + states * sizeof(uint16_t) + lines + data);
+    if (!meta) {
+        fprintf(stderr, "allocate set failed: %s\n", strerror(errno));
+        return -1;
+    }
+    set->valid = (uint8_t*)meta + head + states * sizeof(uint16_t);
+    memset(set->valid, 0, lines);
+    cache->policy->init(cache, set, states ? (uint16_t*)(meta + head) : NULL, index);
+    set->tags = (ull*)meta;
+    return 0;
+}
+
+set_t* cache_set(cache_t* cache, ull index) {
+    set_t** page = &cache->pages[index >> SET_PAGE_BITS];
+    set_t* sets = __atomic_load_n(page, __ATOMIC_ACQUIRE);
+    if (!sets) {
+        // a page may hold the sets of several shard workers
+        pthread_mutex_lock(&cache->arena.lock);
+        sets = *page;
+        if (!sets) {
+            ull count = cache->nsets < SET_PAGE ? cache->nsets : SET_PAGE;
+            sets = arena_bump(&cache->arena, count * sizeof(set_t));
+            if (sets) {
+                memset(sets, 0, count * sizeof(set_t));
+                __atomic_store_n(page, sets, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&cache->arena.lock);
+        if (!sets) {
+            fprintf(stderr, "allocate sets failed: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+    set_t* set = &sets[index & (SET_PAGE - 1)];
+    if (!set->tags && materialize_set(cache, set, index) < 0) return NULL;
+    return set;
+}
+
+set_t* cache_peek_set(const cache_t* cache, ull index) {
+    set_t* sets = __atomic_load_n(&cache->pages[index >> SET_PAGE_BITS], __ATOMIC_ACQUIRE);
+    if (!sets) return NULL;
+    set_t* set = &sets[index & (SET_PAGE - 1)];
+    return set->tags ? set : NULL;
+}
+
+uint8_t* cache_line_data(const cache_t* cache, const set_t* set, long line) {
+    if (!(cache->flags & CACHE_STORE_DATA)) return NULL;
+    return set->valid + cache->lines + line * cache->block_size;
+}
+
+long cache_find(const cache_t* cache, const set_t* set, ull tag) {
+    return cache->match(set->tags, set->valid, cache->lines, tag);
+}
+
+long find_a_empty_line(const cache_t* cache, const set_t* set) {
+    const uint8_t* line = memchr(set->valid, 0, cache->lines);
+    return line ? line - set->valid : -1;
+}
+
+void cache_touch(const cache_t* cache, set_t* set, long line) {
+    cache->policy->touch(cache, set, set_state(cache, set), line);
+}
+
+void cache_fill(const cache_t* cache, set_t* set, long line, ull tag) {
+    set->tags[line] = tag;
+    set->valid[line] = LINE_VALID;
+    if (cache->sector_bits) {
+        cache_sector_valid(cache, set)[line] = ~0ULL;
+        cache_sector_dirty(cache, set)[line] = 0;
+    }
+    cache->policy->fill(cache, set, set_state(cache, set), line);
+}
+
+long evict(const cache_t* cache, set_t* set, uint8_t* flags) {
+    long line = cache->policy->victim(cache, set, set_state(cache, set));
+    if (flags) *flags = set->valid[line];
+    set->valid[line] = 0;
+    return line;
+}
+
+ull cache_dirty_bytes(const cache_t* cache, const set_t* set, long line) {
+    if (!cache->sector_bits) return cache->block_size;
+    return (ull)__builtin_popcountll(cache_sector_dirty(cache, set)[line]) << cache->sector_bits;
+}
+
+uint8_t cache_invalidate(const cache_t* cache, set_t* set, long line) {
+    uint8_t flags = set->valid[line];
+    set->valid[line] = 0;
+    return flags;
+}
+
+/*
+ * Replacement policies
+ */
+
+static void no_update(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+}
+
+/**
+ * Seed the per set random generator kept in repl (splitmix64 of the seed
+ * and the set index, so runs are reproducible whatever the sharding).
+ */
+static void random_init(const cache_t* cache, set_t* set, uint16_t* state, ull index) {
+    uint64_t z = cache->seed + (index + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    set->repl = (z ^ (z >> 31)) | 1;
+}
+
+static uint64_t set_random(set_t* set) {
+    // xorshift64*
+    set->repl ^= set->repl >> 12;
+    set->repl ^= set->repl << 25;
+    set->repl ^= set->repl >> 27;
+    return set->repl * 0x2545F4914F6CDD1DULL;
+}
+
+static long random_victim(const cache_t* cache, set_t* set, uint16_t* state) {
+    return (set_random(set) >> 32) % cache->lines;
+}
+
+static void lru_init(const cache_t* cache, set_t* set, uint16_t* ages, ull index) {
+    // any initial order works, lines are filled before they are evicted
+    set->repl = ~0ULL;
+    for (ull j = 0; j < cache->lines; ++j) {
+        if (ages) ages[j] = j;
+        else set->repl = (set->repl & ~(0xFULL << (4 * j))) | j << (4 * j);
+    }
+}
+
+/**
+ * Mark line as the most recently used line of set.
+ */
+static void lru_move_to_head(const cache_t* cache, set_t* set, uint16_t* ages, long line) {
+    if (!ages) {
+        // find the nibble holding line: the lowest zero nibble of perm ^ line
+        uint64_t perm = set->repl;
+        uint64_t x = perm ^ (NIBBLES_1 * line);
+        unsigned shift = __builtin_ctzll((x - NIBBLES_1) & ~x & NIBBLES_8) & ~3u;
+        // shift the more recent lines down one position, put line first
+        uint64_t newer = perm & ((1ULL << shift) - 1);
+        set->repl = (perm & (~0ULL << shift << 4)) | newer << 4 | line;
+        return;
+    }
+    // every line more recent than line ages by one
+    uint16_t age = ages[line];
+    ull i = 0, n = cache->lines;
+#ifdef __x86_64__
+    __m128i key = _mm_set1_epi16(age);
+    for (; i + 8 <= n; i += 8) {
+        // unsigned ages[i] < age exactly when age - ages[i] does not saturate to 0
+        __m128i v = _mm_loadu_si128((const __m128i*)(ages + i));
+        __m128i older = _mm_cmpeq_epi16(_mm_subs_epu16(key, v), _mm_setzero_si128());
+        v = _mm_sub_epi16(v, _mm_andnot_si128(older, _mm_set1_epi16(-1)));
+        _mm_storeu_si128((__m128i*)(ages + i), v);
+    }
+#endif
+    for (; i < n; ++i) {
+        ages[i] += ages[i] < age;
+    }
+    ages[line] = 0;
+}
+
+/**
+ * The least recently used (or, for FIFO, the oldest filled) line.
+ */
+static long lru_victim(const cache_t* cache, set_t* set, uint16_t* ages) {
+    long last = 0;
+    if (!ages) return set->repl >> (4 * (cache->lines - 1)) & 0xF;
+
+    uint16_t oldest = cache->lines - 1;
+#ifdef __x86_64__
+    __m128i key = _mm_set1_epi16(oldest);
+    for (; last + 8 <= (long)cache->lines; last += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(ages + last));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, key));
+        if (mask) break;
+    }
+#endif
+    while (ages[last] != oldest) ++last;
+    return last;
+}
+
+/**
+ * Tree pseudo-LRU: bit n of repl is node n of a binary tree over the
+ * lines (root 1, children 2n and 2n + 1), set when the pseudo least
+ * recently used half is the right one.
+ */
+static const char* plru_check(ull lines) {
+    if (lines > 64 || (lines & (lines - 1))) return "needs a power of two lines per set, at most 64";
+    return NULL;
+}
+
+static void plru_init(const cache_t* cache, set_t* set, uint16_t* state, ull index) {
+    set->repl = 0;
+}
+
+static void plru_touch(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    for (ull n = cache->lines + line; n > 1; n >>= 1) {
+        // point the parent away from the child just used
+        if (n & 1) set->repl &= ~(1ULL << (n >> 1));
+        else set->repl |= 1ULL << (n >> 1);
+    }
+}
+
+static long plru_victim(const cache_t* cache, set_t* set, uint16_t* state) {
+    ull n = 1;
+    while (n < cache->lines) n = 2 * n + (set->repl >> n & 1);
+    return n - cache->lines;
+}
+
+/**
+ * Not recently used: one reference bit per line, the victim is the first
+ * line without it. When every line is referenced all bits are cleared.
+ */
+static void clear_state(const cache_t* cache, set_t* set, uint16_t* state, ull index) {
+    memset(state, 0, cache->lines * sizeof(uint16_t));
+}
+
+static void nru_touch(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    state[line] = 1;
+}
+
+static long nru_victim(const cache_t* cache, set_t* set, uint16_t* state) {
+    for (ull i = 0; i < cache->lines; ++i) {
+        if (!state[i]) return i;
+    }
+    memset(state, 0, cache->lines * sizeof(uint16_t));
+    return 0;
+}
+
+/**
+ * Least frequently used: a saturating use count per line, ties go to the
+ * lowest line.
+ */
+static void lfu_touch(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    if (state[line] != UINT16_MAX) state[line]++;
+}
+
+static void lfu_fill(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    state[line] = 1;
+}
+
+static long lfu_victim(const cache_t* cache, set_t* set, uint16_t* state) {
+    long victim = 0;
+    for (ull i = 1; i < cache->lines; ++i) {
+        if (state[i] < state[victim]) victim = i;
+    }
+    return victim;
+}
+
+/**
+ * Static and bimodal re-reference interval prediction with 2-bit RRPVs
+ * (Jaleel et al., ISCA 2010). A hit predicts a near re-reference (0),
+ * SRRIP inserts with a long one (2) and BRRIP mostly with a distant one
+ * (3), only one fill in 32 gets a long one.
+ */
+#define RRPV_MAX 3
+
+static void rrip_init(const cache_t* cache, set_t* set, uint16_t* state, ull index) {
+    clear_state(cache, set, state, index);
+    random_init(cache, set, state, index);
+}
+
+static void rrip_touch(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    state[line] = 0;
+}
+
+static void srrip_fill(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    state[line] = RRPV_MAX - 1;
+}
+
+static void brrip_fill(const cache_t* cache, set_t* set, uint16_t* state, long line) {
+    state[line] = set_random(set) >> 59 ? RRPV_MAX : RRPV_MAX - 1;
+}
+
+static long rrip_victim(const cache_t* cache, set_t* set, uint16_t* state) {
+    // age every line until one is predicted distant, in one step
+    uint16_t max = 0;
+    for (ull i = 0; i < cache->lines; ++i) {
+        if (state[i] > max) max = state[i];
+    }
+    long victim = -1;
+    for (ull i = 0; i < cache->lines; ++i) {
+        state[i] += RRPV_MAX - max;
+        if (victim < 0 && state[i] == RRPV_MAX) victim = i;
+    }
+    return victim;
+}
+
+static const policy_t policies[] = {
+    {"lru", LRU_PERM_LINES, NULL, lru_init, lru_move_to_head, lru_move_to_head, lru_victim},
+    {"fifo", LRU_PERM_LINES, NULL, lru_init, no_update, lru_move_to_head, lru_victim},
+    {"random", MAX_LINES, NULL, random_init, no_update, no_update, random_victim},
+    {"plru", MAX_LINES, plru_check, plru_init, plru_touch, plru_touch, plru_victim},
+    {"nru", 0, NULL, clear_state, nru_touch, nru_touch, nru_victim},
+    {"lfu", 0, NULL, clear_state, lfu_touch, lfu_fill, lfu_victim},
+    {"srrip", 0, NULL, rrip_init, rrip_touch, srrip_fill, rrip_victim},
+    {"brrip", 0, NULL, rrip_init, rrip_touch, brrip_fill, rrip_victim},
+};
+
+const policy_t* find_policy(const char* name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        if (strcmp(policies[i].name, name) == 0) return &policies[i];
+    }
+    return NULL;
+}
+
+void print_policies(FILE* out, const char* sep) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        fprintf(out, "%s%s", i ? sep : "", policies[i].name);
+    }
+}
@@ -0,0 +1,277 @@
+/*
+ * cache.h - Storage of the simulated cache: sets of lines, tag lookup
+ * and LRU replacement.
+ */
+
+#ifndef CSIM_CACHE_H
+#define CSIM_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "trace.h"
+
+/**
+ * @brief one (s, E, b) cache geometry
+ */
+typedef struct {
+    int set_bits;
+    long lines;
+    int block_bits;
+} geometry_t;
+
+/**
+ * @brief one set in a cache
+ *
+ * Lines are stored as parallel arrays so a lookup only streams through
+ * the tags. The replacement policy keeps its state in the repl word and,
+ * when it needs one, in a 16-bit state per line right after the tags.
+ *
+ * The LRU order needs no pointers: with at most LRU_PERM_LINES lines it
+ * is a permutation of line indexes packed in repl, one nibble per
+ * position, most recent first. Bigger sets keep an age per line instead,
+ * 0 for the most recent line up to lines - 1 for the least recent one.
+ *
+ * A sectored cache keeps a valid and a dirty mask of sectors per line
+ * between the tags and the states.
+ *
+ * The arrays of a set are carved from the cache arena the first time
+ * the set is used, tags is NULL until then.
+ */
+typedef struct {
+    ull* tags;
+    uint8_t* valid; /**< LINE_* flags, followed by lines * block_size bytes of data with CACHE_STORE_DATA */
+    uint64_t repl;
+} set_t;
+
+/**
+ * Flags of a line, any non zero value is a valid line.
+ */
+enum {
+    LINE_VALID = 1,
+    LINE_DIRTY = 2, /**< modified since it was filled, written back on eviction */
+    LINE_PREFETCHED = 4, /**< brought in by a prefetch and not used yet */
+};
+
+#define LRU_PERM_LINES 16
+#define MAX_LINES 65536
+
+typedef struct cache cache_t;
+
+/**
+ * @brief a replacement policy
+ *
+ * touch is called on a hit, fill when a line gets a new block and victim
+ * picks the line to evict from a full set.
+ */
+typedef struct {
+    const char* name;
+    ull state_above; /**< keep a per line state when lines > state_above */
+    const char* (*check)(ull lines); /**< why lines is unsupported, or NULL */
+    void (*init)(const cache_t* cache, set_t* set, uint16_t* state, ull index);
+    void (*touch)(const cache_t* cache, set_t* set, uint16_t* state, long line);
+    void (*fill)(const cache_t* cache, set_t* set, uint16_t* state, long line);
+    long (*victim)(const cache_t* cache, set_t* set, uint16_t* state);
+} policy_t;
+
+/**
+ * Return the policy called name (lru, fifo, random, plru, nru, lfu,
+ * srrip, brrip) or NULL.
+ */
+const policy_t* find_policy(const char* name);
+
+/**
+ * Print the names of all policies separated by sep.
+ */
+void print_policies(FILE* out, const char* sep);
+
+/**
+ * Tag matchers, return the index of a valid line holding tag or -1.
+ * createCache picks the fastest one the CPU supports, all of them are
+ * exposed for benchmarking.
+ */
+typedef long (*tag_match_fn)(const ull* tags, const uint8_t* valid, ull lines, ull tag);
+
+/**
+ * @brief bump allocator backing the sets of a cache, freed as a whole
+ */
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    size_t used;
+    size_t size;
+} arena_chunk_t;
+
+typedef struct {
+    arena_chunk_t* chunks;
+    pthread_mutex_t lock; /**< sets may be materialized by several workers */
+} arena_t;
+
+/**
+ * createCache options
+ */
+enum {
+    CACHE_STORE_DATA = 1, /**< keep block_size bytes of (unused) data per line */
+};
+
+typedef struct {
+    int flags;
+    const policy_t* policy; /**< NULL for LRU */
+    ull seed; /**< of the random choices of the random and brrip policies */
+    int sector_bits; /**< log2 of the sector size of sectored lines, 0 for whole lines */
+} cache_opts_t;
+
+#define MAX_SECTORS 64
+
+/**
+ * @brief a cache
+ *
+ * Set headers live in pages of SET_PAGE sets, a page is only allocated
+ * when one of its sets is first used, so a sparse trace on a huge cache
+ * only pays for the sets it touches.
+ */
+#define SET_PAGE_BITS 10
+#define SET_PAGE (1ULL << SET_PAGE_BITS)
+
+struct cache {
+    set_t** pages;
+    ull nsets;
+    ull lines;
+    ull block_size;
+    int set_bits;
+    int block_bits;
+    int flags;
+    int sector_bits; /**< 0 when lines are not sectored */
+    tag_match_fn match;
+    const policy_t* policy;
+    bool line_state; /**< the policy keeps a state per line */
+    ull state_offset; /**< of the per line states after the tags, in ull */
+    ull seed;
+    arena_t arena;
+};
+
+long tag_match_scalar(const ull* tags, const uint8_t* valid, ull lines, ull tag);
+long tag_match_sse2(const ull* tags, const uint8_t* valid, ull lines, ull tag);
+long tag_match_avx2(const ull* tags, const uint8_t* valid, ull lines, ull tag);
+bool cpu_has_avx2(void);
+
+/**
+ * Set up an empty cache, the sets themselves are only allocated when
+ * cache_set first returns them. opts may be NULL for the defaults.
+ */
+int createCache(cache_t* cache, const geometry_t* geometry, const cache_opts_t* opts);
+void destroyCache(cache_t* cache);
+
+/**
+ * Return set index of cache, allocating it on first use. NULL if out of memory.
+ */
+set_t* cache_set(cache_t* cache, ull index);
+
+/**
+ * Return set index of cache if it was ever used, NULL otherwise.
+ */
+set_t* cache_peek_set(const cache_t* cache, ull index);
+
+static inline ull cache_set_index(const cache_t* cache, ull addr) {
+    return (addr >> cache->block_bits) & (cache->nsets - 1);
+}
+
+static inline ull cache_tag(const cache_t* cache, ull addr) {
+    int shift = cache->block_bits + cache->set_bits;
+    return shift < 64 ? addr >> shift : 0;
+}
+
+/**
+ * The address of the first byte of the block tag in set index.
+ */
+static inline ull cache_block_addr(const cache_t* cache, ull index, ull tag) {
+    int shift = cache->block_bits + cache->set_bits;
+    return (shift < 64 ? tag << shift : 0) | index << cache->block_bits;
+}
+
+/**
+ * Return the data of line in set, NULL without CACHE_STORE_DATA.
+ */
+uint8_t* cache_line_data(const cache_t* cache, const set_t* set, long line);
+
+/**
+ * Return the index of the line holding tag in set, or -1 on a miss.
+ */
+long cache_find(const cache_t* cache, const set_t* set, ull tag);
+
+/**
+ * Return the index of an invalid line in set, or -1 if the set is full.
+ */
+long find_a_empty_line(const cache_t* cache, const set_t* set);
+
+/**
+ * Tell the policy line of set was hit.
+ */
+void cache_touch(const cache_t* cache, set_t* set, long line);
+
+/**
+ * Put the block tag into the (invalid) line of set.
+ */
+void cache_fill(const cache_t* cache, set_t* set, long line, ull tag);
+
+static inline void cache_mark_dirty(set_t* set, long line) {
+    set->valid[line] |= LINE_DIRTY;
+}
+
+/**
+ * Per line masks of the valid and of the dirty sectors of a sectored
+ * cache. cache_fill makes every sector valid and clean.
+ */
+static inline uint64_t* cache_sector_valid(const cache_t* cache, const set_t* set) {
+    return (uint64_t*)(set->tags + cache->lines);
+}
+
+static inline uint64_t* cache_sector_dirty(const cache_t* cache, const set_t* set) {
+    return (uint64_t*)(set->tags + 2 * cache->lines);
+}
+
+/**
+ * The sectors of the block of addr touched by size bytes from addr, the
+ * bytes past the end of the block are not part of it.
+ */
+static inline uint64_t cache_sector_mask(const cache_t* cache, ull addr, int size) {
+    ull offset = addr & (cache->block_size - 1);
+    ull end = offset + (size > 0 ? size : 1);
+    if (end > cache->block_size) end = cache->block_size;
+    int first = offset >> cache->sector_bits;
+    int last = (end - 1) >> cache->sector_bits;
+    uint64_t upto = last == 63 ? ~0ULL : (2ULL << last) - 1;
+    return upto & ~((1ULL << first) - 1);
+}
+
+/**
+ * Bytes a write back of the evicted line has to write: the whole block,
+ * or only the dirty sectors of a sectored cache.
+ */
+ull cache_dirty_bytes(const cache_t* cache, const set_t* set, long line);
+
+static inline uint8_t cache_line_flags(const set_t* set, long line) {
+    return set->valid[line];
+}
+
+/**
+ * Set or clear LINE_DIRTY and LINE_PREFETCHED flags of a valid line.
+ */
+static inline void cache_set_flags(set_t* set, long line, uint8_t flags, bool on) {
+    if (on) set->valid[line] |= flags;
+    else set->valid[line] &= ~flags;
+}
+
+/**
+ * Use the replacement policy to evict a line of a full set, return the
+ * evicted (now invalid) line. *flags, when not NULL, gets the LINE_*
+ * flags the evicted block had.
+ */
+long evict(const cache_t* cache, set_t* set, uint8_t* flags);
+
+/**
+ * Drop the block in line of set, e.g. when a lower level no longer holds
+ * it. Return the LINE_* flags the block had.
+ */
+uint8_t cache_invalidate(const cache_t* cache, set_t* set, long line);
+
+#endif /* CSIM_CACHE_H */
@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
 #include "cachelab.h"
+#include "trace.h"
+#include "cache.h"
+#include "prefetch.h"
+#include "reuse.h"
+#include "attrib.h"
+#include "tlb.h"
 #include <unistd.h>
 #include <getopt.h>
 #include <stdbool.h>
@@ -7,10 +14,83 @@
 #include <stdint.h>
 #include <memory.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <math.h>
 
-#define MAX_LEN 100
+/**
+ * Misses by cause: the first access of a block, a miss a fully
+ * associative LRU cache of the same capacity would also have, or a miss
+ * only the placement into sets caused.
+ */
+typedef struct {
+    ull compulsory;
+    ull capacity;
+    ull conflict;
+} miss_class_t;
+
+typedef struct {
+    int hit_count;
+    int miss_count;
+    int eviction_count;
+    ull dirty_evictions;
+    ull bytes_written; /**< to the next level, by write-backs and write-throughs */
+    ull sector_misses; /**< misses of a resident tag on sectors it does not hold yet */
+    miss_class_t classes; /**< of the misses with --3c */
+} result_t;
+
+/**
+ * How a cache handles stores, write-back with write-allocate by default.
+ */
+typedef struct {
+    bool through; /**< write every store to the next level instead of marking the line dirty */
+    bool no_allocate; /**< a store miss writes to the next level without filling a line */
+} write_policy_t;
+
+/**
+ * How a level below L1 relates to the levels above it.
+ */
+typedef enum {
+    INCLUSION_NINE, /**< neither inclusive nor exclusive, misses fill every level */
+    INCLUSION_INCLUSIVE, /**< evicting a block drops it from the levels above */
+    INCLUSION_EXCLUSIVE, /**< only holds blocks evicted from above, a hit moves the block up */
+} inclusion_t;
 
-typedef unsigned long long ull;
+#define MAX_LEVELS 8
+#define REUSE_INTERVAL 100000
+#define SHARDS_RATE 0.01
+#define SHARDS_MIN_BLOCKS 4096 /**< fewer sampled blocks give a curve dominated by noise */
+
+/**
+ * One level of a -L hierarchy below the L1 cache. A miss above becomes an
+ * access of this level, a miss here one of next.
+ */
+typedef struct level {
+    geometry_t geometry;
+    inclusion_t inclusion;
+    const policy_t* policy; /**< NULL for the --policy of L1 */
+    write_policy_t write;
+    cache_t cache;
+    result_t res;
+    ull back_invalidations; /**< lines dropped above when this level evicted */
+    struct level* next;
+    cache_t* uppers[MAX_LEVELS]; /**< every cache above, L1 (L1I, the victim cache) first */
+    int nuppers;
+} level_t;
+
+/**
+ * A small fully associative LRU buffer beside the L1 data cache (Jouppi,
+ * ISCA 1990). A victim cache takes the blocks L1 evicts and a hit swaps
+ * the block back into L1, a miss cache keeps a copy of every block L1
+ * missed. Either way a hit serves the L1 miss without the levels below.
+ */
+typedef struct {
+    bool miss_cache; /**< a miss cache instead of a victim cache */
+    long entries;
+    cache_t cache; /**< a single set of entries lines */
+    ull hits; /**< L1 misses it served */
+    ull misses; /**< L1 misses it could not serve */
+} victim_t;
 
 /**
  * csum configuration
@@ -24,62 +104,345 @@ typedef struct {
     ull set_bits;
     ull block_bits;
     FILE* trace_file;
+
+    bool no_mmap; /**< always read the trace through stdio */
+    bool pipeline; /**< parse the trace in a thread of its own */
+    int parse_jobs; /**< threads parsing chunks of a mapped text trace, 0 for none */
+    bool stats; /**< report throughput to stderr */
+    bool store_data; /**< keep the (never read) block data of every line */
+    const policy_t* policy; /**< replacement policy, NULL for LRU */
+    ull seed;
+    write_policy_t write;
+    bool write_stats; /**< report dirty evictions and bytes written */
+
+    geometry_t* sweep; /**< geometries simulated together in one trace pass */
+    size_t sweep_count;
+    int jobs; /**< worker threads */
+    ull max_lines; /**< report LRU results for E = 1..max_lines from one stack-distance pass */
+    level_t* levels; /**< L2, L3, ... fed by the misses of the main (L1) cache */
+    int nlevels;
+    level_t* icache; /**< split L1: the cache of the I records, NULL when they are ignored */
+    victim_t* victim; /**< victim or miss cache of the L1 data cache, NULL for none */
+    tlb_t* tlb; /**< translating the data accesses, NULL for none */
+    int page_bits; /**< of the pages of the TLB, 0 for PAGE_BITS */
+    bool page_walk; /**< read the page table entries of TLB misses through the data cache */
+    result_t walk_res; /**< of those reads */
+    const prefetcher_t* prefetcher; /**< of the L1 data cache, NULL for none */
+    int prefetch_degree;
+    ull prefetch_latency;
+    prefetch_t* prefetch;
+    ull pc; /**< address of the last I record, the PC of the data accesses after it */
+    int sector_bits; /**< sectored L1 data cache, 0 for whole lines */
+    bool reuse; /**< profile reuse distances instead of simulating a cache */
+    ull interval; /**< accesses per working set sample of the reuse profile or heatmap row */
+    int attrib_top; /**< blocks and sets listed by the miss attribution, 0 for none */
+    FILE* heatmap; /**< CSV of the misses per set and window, NULL for none */
+    int pc_top; /**< instructions listed by the per PC attribution, 0 for none */
+    bool pc_addr2line; /**< list only their addresses, for addr2line */
+    reuse_t* shadow; /**< reuse distances of the data blocks, classify the misses with them */
+    miss_class_t* set_classes; /**< of the misses of every set */
+    attrib_t* attrib;
+    bool mrc; /**< print a SHARDS miss ratio curve instead of simulating a cache */
+    double shards_rate; /**< of the sampled blocks, 0 for the default */
+    ull shards_budget; /**< most sampled blocks, 0 for a fixed rate */
+    ull sample; /**< simulate one set in sample and extrapolate, 0 for every set */
+    bool sample_hash; /**< pick the sampled sets by a hash of the index, not every sample-th */
 } config_t;
 
+void usage() {
+    printf("./csim [-hv] -s <s> -E <E> -b <b> -t <tracefile>\n");
+    printf("  <tracefile> is a text trace or a binary trace made by trace2bin\n");
+    printf("  <tracefile> - reads the trace from stdin, e.g. piped from valgrind\n");
+    printf("  --no-mmap  read the trace with stdio instead of mapping it\n");
+    printf("  --pipeline  parse the trace in a thread of its own, ahead of the simulation\n");
+    printf("  --parse-jobs <n>  parse a mapped text trace in chunks on <n> threads, the\n");
+    printf("             records are still simulated in trace order\n");
+    printf("  --stats    print accesses per second to stderr\n");
+    printf("  --store-data  allocate block_size bytes of data per line like real hardware\n");
+    printf("  --policy <name>  replacement policy: ");
+    print_policies(stdout, ", ");
+    printf(" (default lru)\n");
+    printf("  --seed <n>  seed of the random and brrip policies\n");
+    printf("  --write <wb|wt>[,<wa|nwa>]  write-back or write-through, write-allocate or not\n");
+    printf("             (default wb,wa), also reports dirty evictions and bytes written\n");
+    printf("  -L <s>,<E>,<b>[,<option>...]  add a level below the last one, options are an\n");
+    printf("             inclusion: nine (default), inclusive or exclusive, a policy and\n");
+    printf("             wb/wt/wa/nwa; repeat for L3...\n");
+    printf("  --hierarchy <file>  read the -L specs of the lower levels from <file>, one per line\n");
+    printf("  --icache <s>,<E>,<b>[,<policy>]  split L1: simulate the I records in their own\n");
+    printf("             cache, sharing the levels below with the data cache\n");
+    printf("  --victim <n>[,miss]  attach a fully associative victim cache of <n> blocks to\n");
+    printf("             the data cache, or a miss cache with miss, and report its hits\n");
+    printf("  --tlb <entries>,<ways>  add a TLB level translating the data accesses, below\n");
+    printf("             the previous one; repeat for the L2 TLB...\n");
+    printf("  --page-size <size>  of the pages of the TLB: 4k (default), 2m or 1g\n");
+    printf("  --page-walk  read the page table entries of every TLB miss through the data\n");
+    printf("             cache, counted apart from the trace accesses\n");
+    printf("  --prefetch <name>[,<degree>]  prefetch into the data cache: ");
+    print_prefetchers(stdout, ", ");
+    printf("\n");
+    printf("  --prefetch-latency <n>  demand accesses a prefetch takes, earlier uses are late\n");
+    printf("  --sector <bytes>  fill and write back the data cache lines in sectors of <bytes>\n");
+    printf("  --attrib <n>  attribute the misses and evictions to blocks and sets, list the\n");
+    printf("             top <n> of them and the histogram of the sets by evictions\n");
+    printf("  --heatmap <file>  write the misses per set for every --interval accesses\n");
+    printf("             (default %d) to <file> as CSV, implies --attrib %d\n", ATTRIB_WINDOW, ATTRIB_TOP);
+    printf("  --pc <n>[,addr2line]  attribute the data accesses to the instruction of the I\n");
+    printf("             record before them and list the top <n> by misses, or only their\n");
+    printf("             addresses one per line, for addr2line -e <program>\n");
+    printf("  --3c       classify the misses as compulsory, capacity or conflict, in total\n");
+    printf("             and per set\n");
+    printf("  --sample <k>[,hash]  only simulate every k-th set (or 1/k of them picked by a\n");
+    printf("             hash of the index and --seed) and extrapolate the totals; only the\n");
+    printf("             hashed sample is random enough for 95%% confidence intervals, every\n");
+    printf("             k-th set aliases with strided accesses\n");
+    printf("./csim [-h] --sweep <s>,<E>,<b> [--sweep ...] [-j <jobs>] -t <tracefile>\n");
+    printf("  simulate many geometries in one pass and print a table; each field\n");
+    printf("  is a '/' separated list of values or lo-hi ranges, e.g. 0-8,1/2/4/8,6\n");
+    printf("  -j <jobs>  spread the geometries over <jobs> threads\n");
+    printf("./csim [-hv] -s <s> -E <E> -b <b> -j <jobs> -t <tracefile>\n");
+    printf("  shard the sets over <jobs> threads, results are identical to -j 1\n");
+    printf("./csim [-h] -s <s> --stack-dist <Emax> -b <b> -t <tracefile>\n");
+    printf("  LRU hits/misses/evictions for every E = 1..Emax from a single pass\n");
+    printf("./csim [-h] --reuse [--interval <n>] -b <b> -t <tracefile>\n");
+    printf("  histogram of the reuse distances of the blocks, cum-%% is the hit rate of a\n");
+    printf("  fully associative LRU cache as big as the end of the bucket, and the working\n");
+    printf("  set (distinct blocks) of every <n> accesses, default %d\n", REUSE_INTERVAL);
+    printf("./csim [-h] --mrc [--shards-rate <r>] [--shards-budget <n>] -b <b> -t <tracefile>\n");
+    printf("  fully associative LRU miss ratio curve from the reuse distances of a hashed\n");
+    printf("  sample of the blocks, <r> of them (default %g, 1 is exact), or with a budget\n", SHARDS_RATE);
+    printf("  at most <n> blocks whatever the trace, lowering the rate as needed; a warning\n");
+    printf("  tells when fewer than %d blocks were sampled, raise the rate then\n", SHARDS_MIN_BLOCKS);
+}
+
+void printConfig(config_t* config) {
+    if (!config) return;
+    printf("sets: %llu, lines: %llu, block_size: %llu, verbose: %d\n",
+        config->sets, config->lines, config->block_size, config->verbose);
+}
+
+enum {
+    OPT_NO_MMAP = 256,
+    OPT_STATS,
+    OPT_SWEEP,
+    OPT_STACK_DIST,
+    OPT_STORE_DATA,
+    OPT_POLICY,
+    OPT_SEED,
+    OPT_HIERARCHY,
+    OPT_WRITE,
+    OPT_ICACHE,
+    OPT_PREFETCH,
+    OPT_PREFETCH_LATENCY,
+    OPT_SECTOR,
+    OPT_REUSE,
+    OPT_INTERVAL,
+    OPT_SAMPLE,
+    OPT_MRC,
+    OPT_SHARDS_RATE,
+    OPT_SHARDS_BUDGET,
+    OPT_PIPELINE,
+    OPT_PARSE_JOBS,
+    OPT_ATTRIB,
+    OPT_HEATMAP,
+    OPT_PC,
+    OPT_3C,
+    OPT_VICTIM,
+    OPT_TLB,
+    OPT_PAGE_SIZE,
+    OPT_PAGE_WALK,
+};
+
+static const struct option long_options[] = {
+    {"no-mmap", no_argument, NULL, OPT_NO_MMAP},
+    {"pipeline", no_argument, NULL, OPT_PIPELINE},
+    {"parse-jobs", required_argument, NULL, OPT_PARSE_JOBS},
+    {"attrib", required_argument, NULL, OPT_ATTRIB},
+    {"heatmap", required_argument, NULL, OPT_HEATMAP},
+    {"pc", required_argument, NULL, OPT_PC},
+    {"3c", no_argument, NULL, OPT_3C},
+    {"stats", no_argument, NULL, OPT_STATS},
+    {"sweep", required_argument, NULL, OPT_SWEEP},
+    {"jobs", required_argument, NULL, 'j'},
+    {"stack-dist", required_argument, NULL, OPT_STACK_DIST},
+    {"store-data", no_argument, NULL, OPT_STORE_DATA},
+    {"policy", required_argument, NULL, OPT_POLICY},
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"hierarchy", required_argument, NULL, OPT_HIERARCHY},
+    {"write", required_argument, NULL, OPT_WRITE},
+    {"icache", required_argument, NULL, OPT_ICACHE},
+    {"victim", required_argument, NULL, OPT_VICTIM},
+    {"tlb", required_argument, NULL, OPT_TLB},
+    {"page-size", required_argument, NULL, OPT_PAGE_SIZE},
+    {"page-walk", no_argument, NULL, OPT_PAGE_WALK},
+    {"prefetch", required_argument, NULL, OPT_PREFETCH},
+    {"prefetch-latency", required_argument, NULL, OPT_PREFETCH_LATENCY},
+    {"sector", required_argument, NULL, OPT_SECTOR},
+    {"reuse", no_argument, NULL, OPT_REUSE},
+    {"interval", required_argument, NULL, OPT_INTERVAL},
+    {"sample", required_argument, NULL, OPT_SAMPLE},
+    {"mrc", no_argument, NULL, OPT_MRC},
+    {"shards-rate", required_argument, NULL, OPT_SHARDS_RATE},
+    {"shards-budget", required_argument, NULL, OPT_SHARDS_BUDGET},
+    {NULL, 0, NULL, 0},
+};
+
 /**
- * @brief cache line in the set
+ * Parse one field of a sweep spec, e.g. "1/2/4" or "0-8/12", into vals.
+ * Return the number of values, or -1 on a malformed field.
  */
-struct line {
-    bool valid;
-    struct line *prev, *next;
-    ull tag;
-    uint8_t* block;
-};
+static int parse_sweep_field(const char* field, long* vals, int max, long limit) {
+    int n = 0;
+    const char* p = field;
+    while (*p && *p != ',') {
+        char* end;
+        long lo = strtol(p, &end, 10);
+        long hi = lo;
+        if (end == p) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p) return -1;
+        }
+        if (lo < 0 || hi < lo || hi >= limit) return -1;
+        for (long v = lo; v <= hi; ++v) {
+            if (n == max) return -1;
+            vals[n++] = v;
+        }
+        p = end;
+        if (*p == '/') ++p;
+        else if (*p && *p != ',') return -1;
+    }
+    return n;
+}
+
+/**
+ * Append every geometry of a "<s>,<E>,<b>" sweep spec to the config.
+ */
+static int parse_sweep(const char* spec, config_t* config) {
+    enum { MAX_VALUES = 1024 };
+    static long vals[3][MAX_VALUES];
+    static const long limits[3] = {64, 1L << 30, 64};
+    int counts[3];
+    const char* field = spec;
+    for (int i = 0; i < 3; ++i) {
+        counts[i] = parse_sweep_field(field, vals[i], MAX_VALUES, limits[i]);
+        if (counts[i] <= 0) return -1;
+        field = strchr(field, ',');
+        if ((i < 2) != (field != NULL)) return -1;
+        if (field) ++field;
+    }
 
-typedef struct line line_t;
+    size_t total = config->sweep_count + (size_t)counts[0] * counts[1] * counts[2];
+    geometry_t* sweep = realloc(config->sweep, total * sizeof(geometry_t));
+    if (!sweep) return -1;
+    config->sweep = sweep;
+    for (int i = 0; i < counts[0]; ++i) {
+        for (int j = 0; j < counts[1]; ++j) {
+            for (int k = 0; k < counts[2]; ++k) {
+                if (vals[1][j] == 0) return -1;
+                geometry_t* g = &sweep[config->sweep_count++];
+                g->set_bits = vals[0][i];
+                g->lines = vals[1][j];
+                g->block_bits = vals[2][k];
+            }
+        }
+    }
+    return 0;
+}
 
 /**
- * @brief one set in a cache
+ * Apply a write policy keyword: wb, wt, wa or nwa. Return -1 for any
+ * other word.
  */
-typedef struct {
-    line_t* lines; 
-    line_t head, tail;
-} set_t;
+static int parse_write(const char* word, write_policy_t* write) {
+    if (strcmp(word, "wb") == 0) write->through = false;
+    else if (strcmp(word, "wt") == 0) write->through = true;
+    else if (strcmp(word, "wa") == 0) write->no_allocate = false;
+    else if (strcmp(word, "nwa") == 0) write->no_allocate = true;
+    else return -1;
+    return 0;
+}
 
 /**
- * @brief a cache
+ * Parse a cache described by "<s>,<E>,<b>[,<option>...]" into level, an
+ * option is an inclusion, a replacement policy or a write policy keyword.
  */
-typedef struct {
-    set_t* sets;
-} cache_t;
+static int parse_cache_spec(const char* spec, level_t* level) {
+    static const char* inclusions[] = {"nine", "inclusive", "exclusive"};
+    char buf[MAX_LEN];
+    if (strlen(spec) >= sizeof(buf)) return -1;
+    strcpy(buf, spec);
 
-typedef struct {
-    int hit_count;
-    int miss_count;
-    int eviction_count;
-} result_t;
+    char* fields[8] = {NULL};
+    int n = 0;
+    for (char* p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+        if (n == 8) return -1;
+        fields[n++] = p;
+    }
+    if (n < 3) return -1;
 
-typedef struct {
-    int op;
-    ull addr;
-    int size;
-} trace_t;
+    memset(level, 0, sizeof(*level));
+    char* end;
+    level->geometry.set_bits = strtol(fields[0], &end, 10);
+    if (*end || level->geometry.set_bits < 0 || level->geometry.set_bits >= 64) return -1;
+    level->geometry.lines = strtol(fields[1], &end, 10);
+    if (*end || level->geometry.lines <= 0) return -1;
+    level->geometry.block_bits = strtol(fields[2], &end, 10);
+    if (*end || level->geometry.block_bits < 0 || level->geometry.block_bits >= 64) return -1;
+    for (int f = 3; f < n; ++f) {
+        int i = 0;
+        while (i < 3 && strcmp(fields[f], inclusions[i]) != 0) ++i;
+        if (i < 3) level->inclusion = i;
+        else if (parse_write(fields[f], &level->write) < 0
+            && !(level->policy = find_policy(fields[f]))) return -1;
+    }
+    return 0;
+}
 
-void usage() {
-    printf("./csim [-hv] -s <s> -E <E> -b <b> -t <tracefile>\n");
+/**
+ * Append the level described by spec, see parse_cache_spec, to the
+ * hierarchy of config.
+ */
+static int parse_level(const char* spec, config_t* config) {
+    if (config->nlevels == MAX_LEVELS - 2) {
+        fprintf(stderr, "At most %d levels are supported\n", MAX_LEVELS - 1);
+        return -1;
+    }
+    level_t level;
+    if (parse_cache_spec(spec, &level) < 0) return -1;
+
+    level_t* levels = realloc(config->levels, (config->nlevels + 1) * sizeof(level_t));
+    if (!levels) return -1;
+    levels[config->nlevels++] = level;
+    config->levels = levels;
+    return 0;
 }
 
-void printConfig(config_t* config) {
-    if (!config) return;
-    printf("sets: %llu, lines: %llu, block_size: %llu, verbose: %d\n",
-        config->sets, config->lines, config->block_size, config->verbose);
+/**
+ * Read one level spec per line of path, '#' starts a comment.
+ */
+static int parse_hierarchy(const char* path, config_t* config) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    char buf[MAX_LEN];
+    int ret = 0;
+    while (ret == 0 && fgets(buf, sizeof(buf), file)) {
+        char* p = buf + strcspn(buf, "#\r\n");
+        *p = '\0';
+        while (p > buf && (p[-1] == ' ' || p[-1] == '\t')) *--p = '\0';
+        p = buf + strspn(buf, " \t");
+        if (*p) ret = parse_level(p, config);
+    }
+    fclose(file);
+    return ret;
 }
 
 int parseOpt(int argc, char* argv[], config_t* config) {
     if (!config) return -1;
     int opt;
 
-	while((opt = getopt(argc, argv, "hvs:E:b:t:")) != -1) {
+	while((opt = getopt_long(argc, argv, "hvs:E:b:t:j:L:", long_options, NULL)) != -1) {
 		switch (opt) {
             case 'h':
                 usage();
@@ -93,7 +456,7 @@ int parseOpt(int argc, char* argv[], config_t* config) {
                     fprintf(stderr, "The number of set index bits should be 0 <= index < 32\n");
                     return -2;
                 }
-                config->sets = 1 << set_index;
+                config->sets = 1ULL << set_index;
                 config->set_bits = set_index;
                 break;
             }
@@ -112,12 +475,12 @@ int parseOpt(int argc, char* argv[], config_t* config) {
                     fprintf(stderr, "The number of block bits should be 0 <= bits < 64\n");
                     return -4;
                 }
-                config->block_size = 1 << block_index;
+                config->block_size = 1ULL << block_index;
                 config->block_bits = block_index;
                 break;
             }
             case 't': {
-                FILE *file = fopen(optarg, "r");
+                FILE *file = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "r");
                 if (file == NULL) {
                     fprintf(stderr, "Invalid file path\n");
                     return -5;
@@ -125,6 +488,214 @@ int parseOpt(int argc, char* argv[], config_t* config) {
                 config->trace_file = file;
                 break;
             }
+            case OPT_NO_MMAP:
+                config->no_mmap = true;
+                break;
+            case OPT_PIPELINE:
+                config->pipeline = true;
+                break;
+            case OPT_ATTRIB:
+                config->attrib_top = strtol(optarg, NULL, 10);
+                if (config->attrib_top <= 0) {
+                    fprintf(stderr, "The number of blocks and sets listed should be greater than zero\n");
+                    return -18;
+                }
+                break;
+            case OPT_HEATMAP:
+                config->heatmap = fopen(optarg, "w");
+                if (!config->heatmap) {
+                    fprintf(stderr, "Cannot write the heatmap %s: %s\n", optarg, strerror(errno));
+                    return -19;
+                }
+                if (config->attrib_top == 0) config->attrib_top = ATTRIB_TOP;
+                break;
+            case OPT_3C:
+                config->shadow = malloc(sizeof(reuse_t));
+                if (!config->shadow || reuse_init(config->shadow) < 0) return -21;
+                break;
+            case OPT_PC: {
+                char* end;
+                config->pc_top = strtol(optarg, &end, 10);
+                config->pc_addr2line = strcmp(end, ",addr2line") == 0;
+                if (config->pc_top <= 0 || (*end && !config->pc_addr2line)) {
+                    fprintf(stderr, "Invalid instruction attribution: %s\n", optarg);
+                    return -20;
+                }
+                break;
+            }
+            case OPT_PARSE_JOBS:
+                config->parse_jobs = strtol(optarg, NULL, 10);
+                if (config->parse_jobs <= 0) {
+                    fprintf(stderr, "The number of parse jobs should be greater than zero\n");
+                    return -17;
+                }
+                break;
+            case OPT_STATS:
+                config->stats = true;
+                break;
+            case OPT_STORE_DATA:
+                config->store_data = true;
+                break;
+            case OPT_POLICY:
+                config->policy = find_policy(optarg);
+                if (!config->policy) {
+                    fprintf(stderr, "Unknown replacement policy: %s\n", optarg);
+                    return -9;
+                }
+                break;
+            case OPT_SEED:
+                config->seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'L':
+                if (parse_level(optarg, config) < 0) {
+                    fprintf(stderr, "Invalid level spec: %s\n", optarg);
+                    return -10;
+                }
+                break;
+            case OPT_HIERARCHY:
+                if (parse_hierarchy(optarg, config) < 0) {
+                    fprintf(stderr, "Invalid hierarchy file: %s\n", optarg);
+                    return -10;
+                }
+                break;
+            case OPT_ICACHE:
+                config->icache = malloc(sizeof(level_t));
+                if (!config->icache || parse_cache_spec(optarg, config->icache) < 0) {
+                    fprintf(stderr, "Invalid instruction cache spec: %s\n", optarg);
+                    return -12;
+                }
+                break;
+            case OPT_VICTIM: {
+                char* end;
+                config->victim = calloc(1, sizeof(victim_t));
+                if (!config->victim) return -22;
+                config->victim->entries = strtol(optarg, &end, 10);
+                config->victim->miss_cache = strcmp(end, ",miss") == 0;
+                if (config->victim->entries <= 0 || config->victim->entries > MAX_LINES
+                    || (*end && !config->victim->miss_cache)) {
+                    fprintf(stderr, "Invalid victim cache spec: %s\n", optarg);
+                    return -22;
+                }
+                break;
+            }
+            case OPT_TLB: {
+                char* end;
+                long entries = strtol(optarg, &end, 10);
+                long ways = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+                if (!config->tlb) config->tlb = calloc(1, sizeof(tlb_t));
+                if (!config->tlb || *end || tlb_add_level(config->tlb, entries, ways) < 0) {
+                    fprintf(stderr, "Invalid TLB spec: %s\n", optarg);
+                    return -23;
+                }
+                break;
+            }
+            case OPT_PAGE_SIZE: {
+                char* end;
+                ull size = strtoull(optarg, &end, 10);
+                if (*end == 'k' || *end == 'K') size <<= 10;
+                else if (*end == 'm' || *end == 'M') size <<= 20;
+                else if (*end == 'g' || *end == 'G') size <<= 30;
+                if ((*end && end[1]) || size == 0 || (size & (size - 1)) != 0) {
+                    fprintf(stderr, "Invalid page size: %s\n", optarg);
+                    return -24;
+                }
+                config->page_bits = __builtin_ctzll(size);
+                break;
+            }
+            case OPT_PAGE_WALK:
+                config->page_walk = true;
+                break;
+            case OPT_PREFETCH: {
+                char buf[MAX_LEN];
+                snprintf(buf, sizeof(buf), "%s", optarg);
+                char* degree = strchr(buf, ',');
+                if (degree) *degree++ = '\0';
+                config->prefetcher = find_prefetcher(buf);
+                config->prefetch_degree = degree ? strtol(degree, NULL, 10) : 0;
+                if (!config->prefetcher || config->prefetch_degree < 0
+                    || config->prefetch_degree > PREFETCH_MAX_DEGREE) {
+                    fprintf(stderr, "Invalid prefetcher: %s\n", optarg);
+                    return -13;
+                }
+                break;
+            }
+            case OPT_SECTOR: {
+                long size = strtol(optarg, NULL, 10);
+                if (size < 2 || (size & (size - 1)) != 0) {
+                    fprintf(stderr, "The sector size should be a power of two of at least 2 bytes\n");
+                    return -14;
+                }
+                config->sector_bits = __builtin_ctzl(size);
+                break;
+            }
+            case OPT_REUSE:
+                config->reuse = true;
+                break;
+            case OPT_INTERVAL:
+                config->interval = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_MRC:
+                config->mrc = true;
+                break;
+            case OPT_SHARDS_RATE:
+                config->shards_rate = strtod(optarg, NULL);
+                if (config->shards_rate <= 0 || config->shards_rate > 1) {
+                    fprintf(stderr, "The sampling rate should be in (0, 1]\n");
+                    return -16;
+                }
+                break;
+            case OPT_SHARDS_BUDGET:
+                config->shards_budget = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_SAMPLE: {
+                char* end;
+                config->sample = strtoull(optarg, &end, 10);
+                config->sample_hash = strcmp(end, ",hash") == 0;
+                if (config->sample == 0 || (*end && !config->sample_hash)) {
+                    fprintf(stderr, "Invalid sample spec: %s\n", optarg);
+                    return -15;
+                }
+                break;
+            }
+            case OPT_PREFETCH_LATENCY:
+                config->prefetch_latency = strtoull(optarg, NULL, 10);
+                break;
+            case OPT_WRITE: {
+                char buf[MAX_LEN];
+                snprintf(buf, sizeof(buf), "%s", optarg);
+                for (char* p = strtok(buf, ","); p; p = strtok(NULL, ",")) {
+                    if (parse_write(p, &config->write) < 0) {
+                        fprintf(stderr, "Invalid write policy: %s\n", optarg);
+                        return -11;
+                    }
+                }
+                config->write_stats = true;
+                break;
+            }
+            case OPT_SWEEP:
+                if (parse_sweep(optarg, config) < 0) {
+                    fprintf(stderr, "Invalid sweep spec: %s\n", optarg);
+                    return -6;
+                }
+                break;
+            case OPT_STACK_DIST: {
+                long lines = strtol(optarg, NULL, 10);
+                if (lines <= 0) {
+                    fprintf(stderr, "The maximum number of lines per set should be greater than zero\n");
+                    return -8;
+                }
+                config->max_lines = lines;
+                break;
+            }
+            case 'j': {
+                int jobs = strtol(optarg, NULL, 10);
+                if (jobs <= 0) {
+                    fprintf(stderr, "The number of jobs should be greater than zero\n");
+                    return -7;
+                }
+                config->jobs = jobs;
+                break;
+            }
             default:
                 usage();
                 break;
@@ -133,119 +704,290 @@ int parseOpt(int argc, char* argv[], config_t* config) {
     return 0;
 }
 
-int createCache(cache_t* cache, config_t* config) {
-    if (!cache) return -1;
-    cache->sets = malloc(config->sets * sizeof(set_t));
-    if (!cache->sets) {
-        fprintf(stderr, "allocate sets failed: %s\n", strerror(errno));
-        return -2;
+/**
+ * Outcome of one access, see simulate.
+ */
+enum {
+    ACCESS_HIT = 1,
+    ACCESS_MISS = 2,
+    ACCESS_EVICTION = 4,
+    ACCESS_VICTIM = 8, /**< the miss was served by the victim or miss cache */
+};
+
+/**
+ * Print an access the way -v does.
+ */
+static void print_access(const trace_t* trace, int outcome) {
+    printf("%c %llx,%d", trace->op, trace->addr, trace->size);
+    if (outcome & ACCESS_MISS) printf(" miss");
+    if (outcome & ACCESS_VICTIM) printf(" victim-hit");
+    if (outcome & ACCESS_EVICTION) printf(" eviction");
+    if (outcome & ACCESS_HIT) printf(" hit");
+    if (trace->op == 'M') printf(" hit");
+    printf("\n");
+}
+
+static inline ull get_set_index(const config_t* config, ull addr) {
+    return (addr >> config->block_bits) & (config->sets - 1);
+}
+
+static inline ull get_tag(const config_t* config, ull addr) {
+    ull shift = config->block_bits + config->set_bits;
+    return shift < 64 ? addr >> shift : 0;
+}
+
+static void level_write(level_t* level, ull addr, ull bytes);
+static void level_insert(level_t* level, ull addr, bool dirty);
+
+/**
+ * Write bytes at addr, stored by the level owning res, to next (memory
+ * when NULL).
+ */
+static void write_next(level_t* next, result_t* res, ull addr, ull bytes) {
+    res->bytes_written += bytes;
+    if (next) level_write(next, addr, bytes);
+}
+
+/**
+ * Pass the block at addr, just evicted by the level owning res, to next:
+ * an exclusive next level takes it, otherwise only a modified block is
+ * written back, bytes of it.
+ */
+static void evicted_block(level_t* next, result_t* res, ull addr, ull bytes, bool dirty) {
+    if (dirty) {
+        res->dirty_evictions++;
+        res->bytes_written += bytes;
     }
-    memset(cache->sets, 0, sizeof(set_t) * config->sets);
+    if (next && next->inclusion == INCLUSION_EXCLUSIVE) level_insert(next, addr, dirty);
+    else if (next && dirty) level_write(next, addr, bytes);
+}
 
-    for(ull i = 0; i < config->sets; ++i) {
-        cache->sets[i].lines = malloc(config->lines * sizeof(line_t));
-        if (!cache->sets[i].lines) {
-            fprintf(stderr, "allocate sets[%llu].lines failed: %s\n", 
-                i, strerror(errno));
-            goto destroy;
-        }
-        for(ull j = 0; j < config->lines; ++j) {
-            cache->sets[i].lines[j].block = malloc(config->block_size);
-            if (!cache->sets[i].lines[j].block) {
-                fprintf(stderr, "allocate sets[%llu].lines[%llu] block failed: %s\n", 
-                    i, j, strerror(errno));
-                goto destroy;
-            }
-        }
-        cache->sets[i].head.next = &cache->sets[i].tail;
-        cache->sets[i].head.prev = NULL;
-        cache->sets[i].tail.prev = &cache->sets[i].head;
-        cache->sets[i].tail.next = NULL;
+/**
+ * Drop the block at addr from every cache above level, return whether one
+ * of the dropped copies was modified.
+ */
+static bool back_invalidate(level_t* level, ull addr) {
+    bool dirty = false;
+    for (int i = 0; i < level->nuppers; ++i) {
+        cache_t* upper = level->uppers[i];
+        set_t* set = cache_peek_set(upper, cache_set_index(upper, addr));
+        if (!set) continue;
+        long line = cache_find(upper, set, cache_tag(upper, addr));
+        if (line < 0) continue;
+        dirty |= cache_invalidate(upper, set, line) & LINE_DIRTY;
+        level->back_invalidations++;
     }
-    return 0;
-destroy:
-    
-    for (ull i = 0; i < config->sets; ++i) {            
-        if (!cache->sets[i].lines) continue;
-        for (ull j = 0; j < config->lines; ++j) {
-            if (!cache->sets[i].lines[j].block) continue;
-            free(cache->sets[i].lines[j].block);
-        }
-        free(cache->sets[i].lines);
+    return dirty;
+}
+
+/**
+ * Put the block at addr into a line of set, evicting one when the set is
+ * full, and return the line. The evicted block leaves the levels above if
+ * level is inclusive, and goes down as evicted_block says.
+ */
+static long level_fill(level_t* level, set_t* set, ull addr, bool dirty) {
+    cache_t* cache = &level->cache;
+    ull index = cache_set_index(cache, addr);
+    long line = find_a_empty_line(cache, set);
+    if (line < 0) {
+        uint8_t flags;
+        level->res.eviction_count++;
+        line = evict(cache, set, &flags);
+        bool victim_dirty = flags & LINE_DIRTY;
+        ull victim = cache_block_addr(cache, index, set->tags[line]);
+        if (level->inclusion == INCLUSION_INCLUSIVE) victim_dirty |= back_invalidate(level, victim);
+        evicted_block(level->next, &level->res, victim, cache->block_size, victim_dirty);
     }
+    cache_fill(cache, set, line, cache_tag(cache, addr));
+    if (dirty) cache_mark_dirty(set, line);
+    return line;
+}
 
-    free(cache->sets);
-    return -1;
-} 
+/**
+ * Take the block at addr, just evicted from the level above, into the
+ * exclusive level.
+ */
+static void level_insert(level_t* level, ull addr, bool dirty) {
+    cache_t* cache = &level->cache;
+    set_t* set = cache_set(cache, cache_set_index(cache, addr));
+    if (!set) return;
+    long line = cache_find(cache, set, cache_tag(cache, addr));
+    if (line < 0) line = level_fill(level, set, addr, false);
+    if (dirty) cache_mark_dirty(set, line);
+}
 
-void destroyCache(cache_t* cache, config_t* config) {
-    if (!cache) return;
-    if (!cache->sets) return;
-    for(ull i = 0; i < config->sets; ++i) {
-        for(ull j = 0; j < config->lines; ++j) {
-            if (!cache->sets[i].lines) continue;
-            free(cache->sets[i].lines[j].block);
-        }
-        free(cache->sets[i].lines);
+/**
+ * Access the block at addr in level after a miss in the level above,
+ * fetching it from the levels below on a miss. Return whether the block
+ * handed to the level above is modified, which only happens when it
+ * leaves an exclusive level.
+ */
+static bool level_access(level_t* level, ull addr) {
+    cache_t* cache = &level->cache;
+    set_t* set = cache_set(cache, cache_set_index(cache, addr));
+    if (!set) return false;
+    long line = cache_find(cache, set, cache_tag(cache, addr));
+    if (line >= 0) {
+        level->res.hit_count++;
+        // an exclusive level hands the block over to the level above
+        if (level->inclusion == INCLUSION_EXCLUSIVE) return cache_invalidate(cache, set, line) & LINE_DIRTY;
+        cache_touch(cache, set, line);
+        return false;
     }
-    free(cache->sets);
+    level->res.miss_count++;
+    bool dirty = level->next && level_access(level->next, addr);
+    if (level->inclusion == INCLUSION_EXCLUSIVE) return dirty;
+    level_fill(level, set, addr, dirty);
+    return false;
 }
 
 /**
- * Parse a valgrid trace, ignore I operation
- * 
- * format: 
- * I 0400d7d4,8
- *  M/L/S 0421c7f0,4
- */
-trace_t parse_trace(char* buf) {
-    trace_t trace = {0, 0, 0};
-    if (buf[0] == 'I') return trace;
-    if (buf[1] != 'M' && buf[1] != 'L' && buf[1] != 'S') return trace;
-    trace.op = buf[1];
-    char* addr_end;
-    trace.addr = strtol(buf + 3, &addr_end, 16);
-    trace.size = strtol(addr_end + 1, NULL, 10);
-    return trace;
-}
-
-static line_t* find_a_empty_line(cache_t* cache, config_t* config, unsigned set_index) {
-    line_t* line = NULL;
-    for(int i = 0; i < config->lines; ++i) {
-        line = &(cache->sets[set_index].lines[i]);
-        if (!line->valid) {
-            return line;
+ * Write bytes at addr into level, for a store written through or a block
+ * written back by the level above. Writes are not counted as hits or
+ * misses, those are the demand fetches.
+ */
+static void level_write(level_t* level, ull addr, ull bytes) {
+    cache_t* cache = &level->cache;
+    set_t* set = cache_set(cache, cache_set_index(cache, addr));
+    if (!set) return;
+    long line = cache_find(cache, set, cache_tag(cache, addr));
+    if (line >= 0) {
+        cache_touch(cache, set, line);
+    } else if (level->write.no_allocate || level->inclusion == INCLUSION_EXCLUSIVE) {
+        // an exclusive level only takes victims
+        write_next(level->next, &level->res, addr, bytes);
+        return;
+    } else {
+        // a partial write needs the rest of the block first
+        bool dirty = bytes < cache->block_size && level->next && level_access(level->next, addr);
+        line = level_fill(level, set, addr, dirty);
+    }
+    if (level->write.through) write_next(level->next, &level->res, addr, bytes);
+    else cache_mark_dirty(set, line);
+}
+
+/**
+ * Look the block at addr up in the victim or miss cache after a miss of
+ * L1. A victim cache hands the block over, *dirty tells whether it was
+ * modified, a miss cache keeps its clean copy.
+ */
+static bool victim_lookup(victim_t* victim, ull addr, bool* dirty) {
+    cache_t* cache = &victim->cache;
+    set_t* set = cache_set(cache, 0);
+    long line = set ? cache_find(cache, set, cache_tag(cache, addr)) : -1;
+    if (line < 0) {
+        victim->misses++;
+        return false;
+    }
+    victim->hits++;
+    if (victim->miss_cache) {
+        cache_touch(cache, set, line);
+        *dirty = false;
+    } else {
+        *dirty = cache_invalidate(cache, set, line) & LINE_DIRTY;
+    }
+    return true;
+}
+
+/**
+ * Put the block at addr into the victim or miss cache. A full victim
+ * cache passes its LRU block down as evicted_block says, a miss cache
+ * drops it since the levels below still hold it.
+ */
+static void victim_insert(config_t* config, result_t* res, ull addr, bool dirty) {
+    victim_t* victim = config->victim;
+    cache_t* cache = &victim->cache;
+    set_t* set = cache_set(cache, 0);
+    if (!set) return;
+    long line = find_a_empty_line(cache, set);
+    if (line < 0) {
+        uint8_t flags;
+        line = evict(cache, set, &flags);
+        if (!victim->miss_cache) {
+            evicted_block(config->levels, res, cache_block_addr(cache, 0, set->tags[line]),
+                cache->block_size, flags & LINE_DIRTY);
         }
     }
-    return NULL;
+    cache_fill(cache, set, line, cache_tag(cache, addr));
+    if (dirty) cache_mark_dirty(set, line);
 }
 
-static void lru_move_to_head(set_t* set, line_t* line) {
-    line_t* head = &set->head;
-    // line_t* tail = &set->tail;
-    if (line->prev)
-        line->prev->next = line->next;
-    if (line->next)
-        line->next->prev = line->prev;
+/**
+ * Evict a line of the full L1 set index, pass the victim down, or into
+ * the victim cache of the data cache, and return the line.
+ */
+static long l1_evict(config_t* config, cache_t* cache, set_t* set, ull index, result_t* res) {
+    uint8_t flags;
+    long line = evict(cache, set, &flags);
+    if ((flags & LINE_PREFETCHED) && config->prefetch) config->prefetch->useless++;
+    ull addr = cache_block_addr(cache, index, set->tags[line]);
+    victim_t* victim = config->victim;
+    if (victim && !victim->miss_cache && !(config->icache && cache == &config->icache->cache)) {
+        victim_insert(config, res, addr, flags & LINE_DIRTY);
+    } else {
+        evicted_block(config->levels, res, addr, cache_dirty_bytes(cache, set, line), flags & LINE_DIRTY);
+    }
+    return line;
+}
+
+/**
+ * Mark sectors of line modified, every sector of it when sectors is 0.
+ */
+static inline void mark_written(cache_t* cache, set_t* set, long line, uint64_t sectors) {
+    cache_mark_dirty(set, line);
+    if (cache->sector_bits) {
+        cache_sector_dirty(cache, set)[line] |= sectors
+            ? sectors : cache_sector_mask(cache, 0, cache->block_size);
+    }
+}
 
-    // insert after head;
-    line->next = head->next;
-    head->next->prev = line;
-    line->prev = head;
-    head->next = line;
+/**
+ * Train the prefetcher on a demand access of addr and fetch the blocks it
+ * asks for, into the data cache or into its own buffers.
+ */
+static void prefetch(config_t* config, cache_t* cache, result_t* res, ull addr, int event) {
+    prefetch_t* pf = config->prefetch;
+    ull blocks[PREFETCH_MAX_DEGREE];
+    int n = pf->kind->train(pf, config->pc, addr, event, blocks);
+    for (int i = 0; i < n; ++i) {
+        ull block_addr = blocks[i] << cache->block_bits;
+        if (pf->kind->lookup) {
+            if (config->levels) level_access(config->levels, block_addr);
+            prefetch_issued(pf, blocks[i]);
+            continue;
+        }
+        ull index = cache_set_index(cache, block_addr);
+        ull tag = cache_tag(cache, block_addr);
+        set_t* set = cache_set(cache, index);
+        if (!set || cache_find(cache, set, tag) >= 0) continue;
+        bool dirty = config->levels && level_access(config->levels, block_addr);
+        long line = find_a_empty_line(cache, set);
+        if (line < 0) line = l1_evict(config, cache, set, index, res);
+        cache_fill(cache, set, line, tag);
+        cache_set_flags(set, line, LINE_PREFETCHED | (dirty ? LINE_DIRTY : 0), true);
+        prefetch_issued(pf, blocks[i]);
+    }
 }
 
 /**
- * Use LRU to evict a line, return the eivcted line
+ * Classify a miss of the data cache in set index by the reuse distance of
+ * its block: the shadow fully associative LRU cache of the same capacity
+ * holds the blocks with a distance below its capacity.
  */
-static line_t* evict(set_t* set) {
-    // evict the last one;
-    line_t* last = set->tail.prev;
-    last->valid = false;
-    lru_move_to_head(set, last);
-    
-    return set->head.next;
-} 
+static void classify_miss(config_t* config, const cache_t* cache, result_t* res, ull index,
+    ull distance) {
+    miss_class_t* set = &config->set_classes[index];
+    if (distance == REUSE_COLD) {
+        res->classes.compulsory++;
+        set->compulsory++;
+    } else if (distance >= cache->nsets * cache->lines) {
+        res->classes.capacity++;
+        set->capacity++;
+    } else {
+        res->classes.conflict++;
+        set->conflict++;
+    }
+}
 
 /**
  * Simulate a cache.
@@ -255,150 +997,1061 @@ static line_t* evict(set_t* set) {
  * Step3: if tags are same, hit, or miss. In the miss situation, depends on the operation, 
  *        if the operation is load(L), the cache should load from a lower level cache (one miss plus a possible eviction), 
  *        if the operation is store(S), one miss plus a possbile eviction (write-allocation),
+ *        or just a miss written to the next level without write-allocation,
  *        if the operation is modify(M), it can be treated as a load followed by a store, so it may result in two cache hits 
  *        (one load and one store), or a miss and a hit plus a possible eviction (load miss, eviction, and store hit).
+ *
+ * With sectored lines, a resident tag still misses when the access touches
+ * sectors it does not hold; those sectors are fetched and the miss is also
+ * counted as a sector miss.
+ *
+ * With a split L1, I records are simulated the same way in config->icache.
+ * With a prefetcher, every data access also trains it, see prefetch.
+ * With a victim or miss cache, a data miss that hits it does not go to
+ * the levels below, see victim_lookup.
+ * With --3c, every data access also goes through the shadow that tells
+ * the causes of the misses apart, see classify_miss.
+ *
+ * Return the ACCESS_* outcome of the load (or only) part of the access.
  */
-void simulate(trace_t* trace, cache_t* cache,
+int simulate(const trace_t* trace, cache_t* cache,
                 config_t* config, result_t* res) {
-    if (!trace || !cache || !config || !res) return;
-    if (trace->op == 0) return;
+    if (!trace || !cache || !config || !res) return 0;
+    if (trace->op == 0) return 0;
+    if (trace->op == 'I') {
+        config->pc = trace->addr;
+        // instruction fetches only go to the I-cache of a split L1
+        if (!config->icache) return 0;
+        cache = &config->icache->cache;
+        res = &config->icache->res;
+    }
     // Step1, get set index, line tag and block index from address.
-    ull addr = trace->addr;
-    // ull block_index = addr & ((ull)-1 >> (sizeof(ull) - config->block_bits));
-    ull part = (addr & ((ull)-1 >> (sizeof(ull) * 8 - config->block_bits - config->set_bits)));
-    ull set_index = part >> config->block_bits;
-    ull tag = (addr >> (config->block_bits + config->set_bits)) & ((unsigned)-1 >> (config->block_bits + config->set_bits));
-    // Step2
-    bool miss = true;
-    line_t* line = NULL;
-    for(int i = 0; i < config->lines; ++i) {
-        line = &(cache->sets[set_index].lines[i]);
-        if (line->valid && tag == line->tag) {
-            miss = false;
-            break;
-        }
+    ull set_index = cache_set_index(cache, trace->addr);
+    ull tag = cache_tag(cache, trace->addr);
+    set_t* set = cache_set(cache, set_index);
+    if (!set) return 0;
+    int outcome;
+    bool store = trace->op == 'S';
+    bool allocate = !(store && config->write.no_allocate);
+    prefetch_t* pf = trace->op != 'I' ? config->prefetch : NULL;
+    victim_t* victim = trace->op != 'I' ? config->victim : NULL;
+    ull distance = config->shadow && trace->op != 'I'
+        ? reuse_access(config->shadow, trace->addr >> cache->block_bits) : REUSE_COLD;
+    int event = PREFETCH_MISS;
+    if (pf) {
+        pf->tick++;
+        prefetch_baseline(pf, trace->addr, allocate);
     }
+    // Step2
+    uint64_t sectors = cache->sector_bits ? cache_sector_mask(cache, trace->addr, trace->size) : 0;
+    long line = cache_find(cache, set, tag);
+    uint64_t missing = line >= 0 && sectors ? sectors & ~cache_sector_valid(cache, set)[line] : 0;
     // Step3
-    // hit situation
-    if (!miss) {
-        if (config->verbose) {
-            printf("%c %llx,%d ", trace->op, trace->addr, trace->size);
+    if (line >= 0 && missing) {
+        // sector miss, fetch the missing sectors of the resident block
+        outcome = ACCESS_MISS;
+        res->miss_count++;
+        res->sector_misses++;
+        cache_touch(cache, set, line);
+        if (allocate) {
+            if (config->levels) level_access(config->levels, trace->addr);
+            cache_sector_valid(cache, set)[line] |= missing;
+        } else {
+            line = -1;
         }
-        if (trace->op == 'M') {
-            res->hit_count+=2;
-            if (config->verbose)
-                printf("hit hit\n");
+    } else if (line >= 0) {
+        // hit situation
+        outcome = ACCESS_HIT;
+        res->hit_count++;
+        cache_touch(cache, set, line);
+        event = 0;
+        if (pf && (cache_line_flags(set, line) & LINE_PREFETCHED)) {
+            cache_set_flags(set, line, LINE_PREFETCHED, false);
+            prefetch_used(pf, trace->addr >> cache->block_bits);
+            event = PREFETCH_HIT;
+        }
+    } else if (!allocate) {
+        outcome = ACCESS_MISS;
+        res->miss_count++;
+        if (pf) pf->demand_misses++;
+    } else {
+        // miss situation, L, S (write-allocation) and the load of M all
+        // bring the block in, into an empty line or by evicting one.
+        outcome = ACCESS_MISS;
+        res->miss_count++;
+        bool dirty = false;
+        ull block = trace->addr >> cache->block_bits;
+        if (pf && pf->kind->lookup && pf->kind->lookup(pf, block)) {
+            // served by a stream buffer
+            prefetch_used(pf, block);
+            event |= PREFETCH_HIT;
+        } else if (victim && victim_lookup(victim, trace->addr, &dirty)) {
+            // served by the victim or miss cache, a victim cache swaps
+            // it with the block L1 evicts for it
+            outcome |= ACCESS_VICTIM;
         } else {
-            res->hit_count++;
-            if (config->verbose) {
-                printf("hit\n");
+            if (pf) pf->demand_misses++;
+            dirty = config->levels && level_access(config->levels, trace->addr);
+            if (victim && victim->miss_cache) victim_insert(config, res, trace->addr, false);
+        }
+        line = find_a_empty_line(cache, set);
+        if (line < 0) {
+            outcome |= ACCESS_EVICTION;
+            res->eviction_count++;
+            line = l1_evict(config, cache, set, set_index, res);
+        }
+        cache_fill(cache, set, line, tag);
+        if (dirty) mark_written(cache, set, line, 0);
+        else if (sectors) cache_sector_valid(cache, set)[line] = sectors;
+    }
+    // S and the store of M write the line, or the next level when it is
+    // write-through or the store missed without write-allocation
+    if (store || trace->op == 'M') {
+        if (line < 0 || config->write.through) write_next(config->levels, res, trace->addr, trace->size);
+        else mark_written(cache, set, line, sectors);
+    }
+    // the store of M always hits
+    if (trace->op == 'M') res->hit_count++;
+    if (pf) prefetch(config, cache, res, trace->addr, event);
+    if (config->shadow && trace->op != 'I' && (outcome & ACCESS_MISS)) {
+        classify_miss(config, cache, res, set_index, distance);
+    }
+
+    if (config->verbose) print_access(trace, outcome);
+    return outcome;
+}
+
+static cache_opts_t cache_options(const config_t* config) {
+    cache_opts_t opts = {0, config->policy, config->seed};
+    if (config->store_data) opts.flags |= CACHE_STORE_DATA;
+    return opts;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Open the trace of config, with parser threads when asked to. A mapped
+ * text trace is parsed in chunks with --parse-jobs, anything else goes
+ * through the --pipeline thread.
+ */
+static int open_trace(const config_t* config, trace_reader_t* reader) {
+    if (trace_open(reader, config->trace_file, !config->no_mmap) < 0) return -1;
+    if (config->parse_jobs > 0 && trace_parallel(reader, config->parse_jobs) < 0) return -1;
+    if (config->pipeline && trace_pipeline(reader) < 0) {
+        trace_close(reader);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Mattson stack-distance state: per set, the tags of the max_lines most
+ * recently used blocks, most recent first. A block at depth d (1-based)
+ * hits in every LRU cache with E >= d lines per set.
+ */
+typedef struct {
+    ull* tags; /**< sets * max_lines */
+    ull* depth; /**< valid entries per set */
+    ull* hist; /**< hist[d] accesses at distance d, hist[max_lines + 1] deeper or cold */
+    ull store_hits; /**< the store half of an M always hits */
+} stack_dist_t;
+
+/**
+ * Account one access in the stack-distance histogram and move its tag to
+ * the top of its set's stack.
+ */
+static void stack_distance(const trace_t* trace, stack_dist_t* sd, config_t* config) {
+    if (trace->op == 0 || trace->op == 'I') return;
+    ull set_index = get_set_index(config, trace->addr);
+    ull tag = get_tag(config, trace->addr);
+    ull* stack = &sd->tags[set_index * config->max_lines];
+    ull depth = sd->depth[set_index];
+
+    ull d = 0;
+    while (d < depth && stack[d] != tag) ++d;
+    if (d == depth) {
+        sd->hist[config->max_lines + 1]++;
+        if (depth < config->max_lines) sd->depth[set_index] = ++depth;
+        d = depth - 1;
+    } else {
+        sd->hist[d + 1]++;
+    }
+    memmove(stack + 1, stack, d * sizeof(ull));
+    stack[0] = tag;
+    if (trace->op == 'M') sd->store_hits++;
+}
+
+/**
+ * Derive the LRU results of every E = 1..max_lines from the histogram.
+ *
+ * A set fills its empty lines on its first misses and never empties a
+ * line again, so the number of misses without eviction is
+ * min(E, distinct blocks of the set). While a set has seen fewer than
+ * max_lines blocks its stack holds all of them, so that is min(E, depth).
+ */
+static int run_stack_dist(config_t* config) {
+    ull emax = config->max_lines;
+    stack_dist_t sd;
+    sd.tags = malloc(config->sets * emax * sizeof(ull));
+    sd.depth = calloc(config->sets, sizeof(ull));
+    sd.hist = calloc(emax + 2, sizeof(ull));
+    sd.store_hits = 0;
+    ull* depth_count = calloc(emax + 1, sizeof(ull));
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!sd.tags || !sd.depth || !sd.hist || !depth_count || !reader) {
+        fprintf(stderr, "allocate stack distance state failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (open_trace(config, reader) < 0) return -1;
+
+    const trace_t* recs;
+    size_t n;
+    ull accesses = 0;
+    double start = now();
+    while ((n = trace_next(reader, &recs)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            stack_distance(&recs[i], &sd, config);
+        }
+    }
+    double elapsed = now() - start;
+    bool failed = reader->error;
+    trace_close(reader);
+    if (failed) return -1;
+
+    for (ull i = 0; i < config->sets; ++i) depth_count[sd.depth[i]]++;
+    for (ull d = 1; d <= emax + 1; ++d) accesses += sd.hist[d];
+
+    printf("%6s %12s %12s %12s %12s\n", "E", "distance", "hits", "misses", "evictions");
+    ull hits = 0;
+    ull filled = 0; /**< sets with at least E distinct blocks */
+    ull fills = 0; /**< sum over sets of min(E, depth) */
+    for (ull d = 1; d <= emax; ++d) filled += depth_count[d];
+    for (ull e = 1; e <= emax; ++e) {
+        hits += sd.hist[e];
+        fills += filled;
+        filled -= depth_count[e];
+        ull misses = accesses - hits;
+        printf("%6llu %12llu %12llu %12llu %12llu\n", e, sd.hist[e],
+            hits + sd.store_hits, misses, misses - fills);
+    }
+    printf("%6s %12llu\n", ">max", sd.hist[emax + 1]);
+    if (config->stats) {
+        fprintf(stderr, "accesses: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+
+    free(reader);
+    free(depth_count);
+    free(sd.hist);
+    free(sd.depth);
+    free(sd.tags);
+    return 0;
+}
+
+/**
+ * Profile the data blocks of the trace: print the working set of every
+ * config->interval accesses while streaming, then the histogram of the
+ * reuse distances in log2 buckets.
+ *
+ * A block first touched in the current interval has a reuse distance
+ * below the number of blocks the interval touched so far, any other block
+ * is at least that far, so the working set needs no state of its own.
+ */
+static int run_reuse(config_t* config) {
+    enum { COLD = 65 };
+    ull hist[COLD + 1] = {0};
+    reuse_t reuse;
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!reader || reuse_init(&reuse) < 0) {
+        free(reader);
+        return -1;
+    }
+    if (open_trace(config, reader) < 0) return -1;
+
+    const trace_t* recs;
+    size_t n;
+    ull accesses = 0, working_set = 0;
+    double start = now();
+    printf("%12s %12s %14s\n", "accesses", "blocks", "bytes");
+    while ((n = trace_next(reader, &recs)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            if (recs[i].op == 'I') continue;
+            ull d = reuse_access(&reuse, recs[i].addr >> config->block_bits);
+            hist[d == REUSE_COLD ? COLD : reuse_bucket(d)]++;
+            if (d == REUSE_COLD || d >= working_set) working_set++;
+            if (++accesses % config->interval == 0) {
+                printf("%12llu %12llu %14llu\n", accesses, working_set,
+                    working_set << config->block_bits);
+                working_set = 0;
+            }
+        }
+    }
+    if (accesses % config->interval) {
+        printf("%12llu %12llu %14llu\n", accesses, working_set, working_set << config->block_bits);
+    }
+    double elapsed = now() - start;
+    bool failed = reader->error;
+    trace_close(reader);
+    if (failed) return -1;
+
+    printf("\n%23s %12s %8s\n", "distance", "accesses", "cum-%");
+    ull sum = 0;
+    int last = COLD - 1;
+    while (last > 0 && hist[last] == 0) --last;
+    for (int k = 0; k <= last; ++k) {
+        ull lo = k == 0 ? 0 : 1ULL << (k - 1);
+        ull hi = k == 0 ? 0 : (k == 64 ? ~0ULL : (1ULL << k) - 1);
+        sum += hist[k];
+        printf("%11llu-%-11llu %12llu %8.3f\n", lo, hi, hist[k],
+            accesses ? 100.0 * sum / accesses : 0.0);
+    }
+    printf("%23s %12llu\n", "cold", hist[COLD]);
+    printf("accesses:%llu blocks:%llu footprint:%llu\n", accesses, reuse.blocks,
+        reuse.blocks << config->block_bits);
+    if (config->stats) {
+        fprintf(stderr, "accesses: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+    reuse_destroy(&reuse);
+    free(reader);
+    return 0;
+}
+
+#define SHARD_BATCH (1 << 20)
+
+/**
+ * One worker of a set-sharded run. Worker i owns the sets
+ * [i * sets_per_job, (i + 1) * sets_per_job) and only ever touches those.
+ */
+typedef struct {
+    config_t config; /**< quiet copy, the outcomes are printed in trace order */
+    cache_t* cache;
+    result_t res;
+    const trace_t* recs;
+    const uint32_t* queue; /**< indexes into recs of the accesses to this worker's sets */
+    size_t len;
+    uint8_t* outcomes; /**< per record outcome when -v is on */
+    pthread_barrier_t* batch_ready;
+    pthread_barrier_t* batch_done;
+} shard_worker_t;
+
+static void shard_batch(shard_worker_t* w) {
+    for (size_t i = 0; i < w->len; ++i) {
+        uint32_t idx = w->queue[i];
+        int outcome = simulate(&w->recs[idx], w->cache, &w->config, &w->res);
+        if (w->outcomes) w->outcomes[idx] = outcome;
+    }
+}
+
+static void* shard_thread(void* arg) {
+    shard_worker_t* w = arg;
+    for (;;) {
+        pthread_barrier_wait(w->batch_ready);
+        if (w->recs == NULL) break;
+        shard_batch(w);
+        pthread_barrier_wait(w->batch_done);
+    }
+    return NULL;
+}
+
+/**
+ * Simulate with the sets sharded over config->jobs threads. Accesses are
+ * staged in batches, bucketed by owning worker (a counting sort keeps each
+ * worker's accesses in trace order), and simulated in parallel. Sets are
+ * independent, so the counters simply add up and match the serial run.
+ */
+static void free_shards(trace_reader_t* reader, pthread_t* threads, shard_worker_t* workers,
+    size_t* start, uint8_t* outcomes, uint32_t* queue, uint16_t* owner, trace_t* batch) {
+    free(reader);
+    free(threads);
+    free(workers);
+    free(start);
+    free(outcomes);
+    free(queue);
+    free(owner);
+    free(batch);
+}
+
+static int run_sharded(config_t* config, cache_t* cache, result_t* res) {
+    ull jobs = config->jobs;
+    if (jobs > config->sets) jobs = config->sets;
+    if (jobs > UINT16_MAX) jobs = UINT16_MAX;
+    ull sets_per_job = (config->sets + jobs - 1) / jobs;
+    jobs = (config->sets + sets_per_job - 1) / sets_per_job;
+
+    trace_t* batch = malloc(SHARD_BATCH * sizeof(trace_t));
+    uint16_t* owner = malloc(SHARD_BATCH * sizeof(uint16_t));
+    uint32_t* queue = malloc(SHARD_BATCH * sizeof(uint32_t));
+    uint8_t* outcomes = config->verbose ? malloc(SHARD_BATCH) : NULL;
+    size_t* start = calloc(jobs + 1, sizeof(size_t));
+    shard_worker_t* workers = calloc(jobs, sizeof(shard_worker_t));
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!batch || !owner || !queue || (config->verbose && !outcomes)
+        || !start || !workers || !threads || !reader) {
+        fprintf(stderr, "allocate shards failed: %s\n", strerror(errno));
+        free_shards(reader, threads, workers, start, outcomes, queue, owner, batch);
+        return -1;
+    }
+    if (open_trace(config, reader) < 0) {
+        free_shards(reader, threads, workers, start, outcomes, queue, owner, batch);
+        return -1;
+    }
+
+    pthread_barrier_t batch_ready, batch_done;
+    pthread_barrier_init(&batch_ready, NULL, jobs);
+    pthread_barrier_init(&batch_done, NULL, jobs);
+    for (ull i = 0; i < jobs; ++i) {
+        workers[i].config = *config;
+        workers[i].config.verbose = false;
+        workers[i].cache = cache;
+        workers[i].outcomes = outcomes;
+        workers[i].batch_ready = &batch_ready;
+        workers[i].batch_done = &batch_done;
+        if (i > 0) pthread_create(&threads[i], NULL, shard_thread, &workers[i]);
+    }
+
+    ull accesses = 0;
+    double t0 = now();
+    const trace_t* recs = NULL;
+    size_t n = 0, next = 0;
+    for (;;) {
+        // stage data accesses until the batch is full or the trace ends
+        size_t len = 0;
+        while (len < SHARD_BATCH) {
+            if (next == n) {
+                n = trace_next(reader, &recs);
+                next = 0;
+                if (n == 0) break;
             }
+            const trace_t* rec = &recs[next++];
+            if (rec->op != 'I') batch[len++] = *rec;
+        }
+        if (len == 0) break;
+
+        memset(start, 0, (jobs + 1) * sizeof(size_t));
+        for (size_t i = 0; i < len; ++i) {
+            owner[i] = get_set_index(config, batch[i].addr) / sets_per_job;
+            start[owner[i] + 1]++;
+        }
+        for (ull j = 0; j < jobs; ++j) start[j + 1] += start[j];
+        for (ull j = 0; j < jobs; ++j) {
+            workers[j].recs = batch;
+            workers[j].queue = queue + start[j];
+            workers[j].len = start[j + 1] - start[j];
         }
-        lru_move_to_head(&cache->sets[set_index], line);
+        for (size_t i = 0; i < len; ++i) queue[start[owner[i]]++] = i;
+
+        pthread_barrier_wait(&batch_ready);
+        shard_batch(&workers[0]);
+        pthread_barrier_wait(&batch_done);
+
+        if (outcomes) {
+            for (size_t i = 0; i < len; ++i) print_access(&batch[i], outcomes[i]);
+        }
+        accesses += len;
+    }
+
+    for (ull j = 0; j < jobs; ++j) workers[j].recs = NULL;
+    pthread_barrier_wait(&batch_ready);
+    for (ull j = 1; j < jobs; ++j) pthread_join(threads[j], NULL);
+
+    memset(res, 0, sizeof(*res));
+    for (ull j = 0; j < jobs; ++j) {
+        res->hit_count += workers[j].res.hit_count;
+        res->miss_count += workers[j].res.miss_count;
+        res->eviction_count += workers[j].res.eviction_count;
+        res->dirty_evictions += workers[j].res.dirty_evictions;
+        res->sector_misses += workers[j].res.sector_misses;
+        res->bytes_written += workers[j].res.bytes_written;
+    }
+    if (config->stats) {
+        double elapsed = now() - t0;
+        fprintf(stderr, "accesses: %llu, jobs: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, jobs, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+
+    bool failed = reader->error;
+    trace_close(reader);
+    pthread_barrier_destroy(&batch_ready);
+    pthread_barrier_destroy(&batch_done);
+    free_shards(reader, threads, workers, start, outcomes, queue, owner, batch);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Create the caches of the levels below cache and chain them.
+ */
+static int setup_hierarchy(config_t* config, cache_t* cache) {
+    level_t* icache = config->icache;
+    if (icache) {
+        if (config->nlevels > 0 && icache->geometry.block_bits != (int)config->block_bits) {
+            fprintf(stderr, "L1I: every level must use the block size of L1\n");
+            return -1;
+        }
+        cache_opts_t opts = cache_options(config);
+        if (icache->policy) opts.policy = icache->policy;
+        if (createCache(&icache->cache, &icache->geometry, &opts) < 0) return -1;
+    }
+    if (config->tlb && tlb_create(config->tlb, config->page_bits ? config->page_bits : PAGE_BITS) < 0) {
+        return -1;
+    }
+    victim_t* victim = config->victim;
+    if (victim) {
+        geometry_t geometry = {0, victim->entries, config->block_bits};
+        cache_opts_t opts = cache_options(config);
+        opts.policy = NULL;
+        if (createCache(&victim->cache, &geometry, &opts) < 0) return -1;
+    }
+    if (config->prefetcher) {
+        geometry_t geometry = {config->set_bits, config->lines, config->block_bits};
+        cache_opts_t opts = cache_options(config);
+        config->prefetch = malloc(sizeof(prefetch_t));
+        if (!config->prefetch || prefetch_create(config->prefetch, config->prefetcher,
+                config->prefetch_degree, config->prefetch_latency, &geometry, &opts) < 0) return -1;
+    }
+    for (int i = 0; i < config->nlevels; ++i) {
+        level_t* level = &config->levels[i];
+        if (level->geometry.block_bits != (int)config->block_bits) {
+            fprintf(stderr, "L%d: every level must use the block size of L1\n", i + 2);
+            return -1;
+        }
+        cache_opts_t opts = cache_options(config);
+        if (level->policy) opts.policy = level->policy;
+        if (createCache(&level->cache, &level->geometry, &opts) < 0) return -1;
+        level->next = i + 1 < config->nlevels ? &config->levels[i + 1] : NULL;
+        level->uppers[level->nuppers++] = cache;
+        if (icache) level->uppers[level->nuppers++] = &icache->cache;
+        if (victim) level->uppers[level->nuppers++] = &victim->cache;
+        for (int j = 0; j < i; ++j) level->uppers[level->nuppers++] = &config->levels[j].cache;
+    }
+    return 0;
+}
+
+/**
+ * Print the write traffic of L1 and the results of the levels below it.
+ */
+static void print_levels(const config_t* config, const result_t* l1) {
+    if (config->icache) {
+        const result_t* res = &config->icache->res;
+        printf("L1I hits:%d misses:%d evictions:%d\n",
+            res->hit_count, res->miss_count, res->eviction_count);
+    }
+    const prefetch_t* pf = config->prefetch;
+    if (pf) {
+        ull cut = pf->baseline_misses > pf->demand_misses ? pf->baseline_misses - pf->demand_misses : 0;
+        printf("prefetch:%s issued:%llu useful:%llu late:%llu useless:%llu "
+            "accuracy:%.2f%% coverage:%.2f%%\n", pf->kind->name, pf->issued, pf->useful,
+            pf->late, pf->useless, pf->issued ? 100.0 * pf->useful / pf->issued : 0.0,
+            pf->baseline_misses ? 100.0 * pf->useful / pf->baseline_misses : 0.0);
+        printf("demand-misses:%llu baseline-misses:%llu reduction:%.2f%%\n", pf->demand_misses,
+            pf->baseline_misses, pf->baseline_misses ? 100.0 * cut / pf->baseline_misses : 0.0);
+    }
+    const victim_t* victim = config->victim;
+    if (victim) {
+        printf("%s entries:%ld hits:%llu misses:%llu hit-rate:%.2f%%\n",
+            victim->miss_cache ? "miss-cache" : "victim-cache", victim->entries, victim->hits,
+            victim->misses, victim->hits + victim->misses
+                ? 100.0 * victim->hits / (victim->hits + victim->misses) : 0.0);
+    }
+    if (config->tlb) {
+        tlb_report(config->tlb, stdout);
+        if (config->page_walk) {
+            const result_t* walk = &config->walk_res;
+            printf("walk hits:%d misses:%d evictions:%d\n",
+                walk->hit_count, walk->miss_count, walk->eviction_count);
+        }
+    }
+    if (config->sector_bits) {
+        printf("L1 sector-misses:%llu tag-misses:%llu\n",
+            l1->sector_misses, l1->miss_count - l1->sector_misses);
+    }
+    if (config->write_stats || config->nlevels > 0) {
+        printf("L1 dirty-evictions:%llu bytes-written:%llu\n",
+            l1->dirty_evictions, l1->bytes_written);
+    }
+    for (int i = 0; i < config->nlevels; ++i) {
+        const level_t* level = &config->levels[i];
+        printf("L%d hits:%d misses:%d evictions:%d back-invalidations:%llu "
+            "dirty-evictions:%llu bytes-written:%llu\n", i + 2,
+            level->res.hit_count, level->res.miss_count, level->res.eviction_count,
+            level->back_invalidations, level->res.dirty_evictions, level->res.bytes_written);
+    }
+}
+
+/**
+ * Print the causes of the misses of the data cache, then of every set
+ * that missed.
+ */
+static void print_classes(const config_t* config, const result_t* res) {
+    printf("compulsory:%llu capacity:%llu conflict:%llu\n", res->classes.compulsory,
+        res->classes.capacity, res->classes.conflict);
+    printf("%8s %12s %12s %12s\n", "set", "compulsory", "capacity", "conflict");
+    for (ull i = 0; i < config->sets; ++i) {
+        const miss_class_t* c = &config->set_classes[i];
+        if (c->compulsory + c->capacity + c->conflict == 0) continue;
+        printf("%8llu %12llu %12llu %12llu\n", i, c->compulsory, c->capacity, c->conflict);
+    }
+}
+
+/**
+ * Load the page table entry at addr into the data cache for a page walk,
+ * counted in walk_res. Only the caches see it: unlike the accesses of the
+ * trace it does not train the prefetcher, go through the --3c shadow or
+ * show up in -v and the attribution.
+ */
+static void walk_load(config_t* config, cache_t* cache, ull addr) {
+    result_t* res = &config->walk_res;
+    ull index = cache_set_index(cache, addr);
+    set_t* set = cache_set(cache, index);
+    if (!set) return;
+    uint64_t sectors = cache->sector_bits ? cache_sector_mask(cache, addr, PAGE_TABLE_ENTRY) : 0;
+    long line = cache_find(cache, set, cache_tag(cache, addr));
+    if (line >= 0 && !(sectors & ~cache_sector_valid(cache, set)[line])) {
+        res->hit_count++;
+        cache_touch(cache, set, line);
         return;
     }
-    // miss situration
     res->miss_count++;
-    switch(trace->op) {
-        case 'L':
-            // load instruction, the cache should load from the lower cache.
-            // find a empty line
-            {
-                line_t* line = find_a_empty_line(cache, config, set_index);
-                if (!line) {
-                    // eviction
-                    res->eviction_count ++;
-                    line_t* newline = evict(&cache->sets[set_index]);
-                    newline->tag = tag;
-                    newline->valid = true;
-                } else {
-                    line->valid = true;
-                    line->tag = tag;
-                    lru_move_to_head(&cache->sets[set_index], line);
-                }
-                if (config->verbose) {
-                    if (line) {
-                        printf("L %llx,%d miss\n", trace->addr, trace->size);
-                    } else {
-                        printf("L %llx,%d miss eviction\n", trace->addr, trace->size);
-                    }
-                }
-                break;
-            }
-        case 'S': 
-            {
-                // store instruction, if miss, find a empty line
-                line_t* line = find_a_empty_line(cache, config, set_index);
-                if (!line) {
-                    res->eviction_count ++;
-                    line_t* newline = evict(&cache->sets[set_index]);
-                    newline->tag = tag;
-                    newline->valid = true;
-                } else {
-                    line->valid = true;
-                    line->tag = tag;
-                    lru_move_to_head(&cache->sets[set_index], line);
-                }
-                if (config->verbose) {
-                    if (line) {
-                        printf("S %llx,%d miss\n", trace->addr, trace->size);
-                    } else {
-                        printf("S %llx,%d miss eviction\n", trace->addr, trace->size);
-                    }
-                }
-                break;
+    bool dirty = config->levels && level_access(config->levels, addr);
+    if (line >= 0) {
+        // sector miss of a resident block
+        res->sector_misses++;
+        cache_touch(cache, set, line);
+        cache_sector_valid(cache, set)[line] |= sectors;
+        return;
+    }
+    line = find_a_empty_line(cache, set);
+    if (line < 0) {
+        res->eviction_count++;
+        line = l1_evict(config, cache, set, index, res);
+    }
+    cache_fill(cache, set, line, cache_tag(cache, addr));
+    if (dirty) mark_written(cache, set, line, 0);
+    else if (sectors) cache_sector_valid(cache, set)[line] = sectors;
+}
+
+/**
+ * Look the page of the data address addr up in the TLB. With --page-walk
+ * the page table entries a miss reads are loaded into the data cache
+ * first, see walk_load.
+ */
+static void translate(config_t* config, cache_t* cache, ull addr) {
+    ull walk[WALK_LEVELS];
+    int n = tlb_access(config->tlb, addr, walk);
+    if (!config->page_walk) return;
+    for (int i = 0; i < n; ++i) walk_load(config, cache, walk[i]);
+}
+
+/**
+ * Simulate the trace of config on cache into res, return -1 when it could
+ * not be read.
+ */
+int run(config_t* config, cache_t* cache, result_t* res) {
+    if (config->jobs > 1) return run_sharded(config, cache, res);
+
+    memset(res, 0, sizeof(*res));
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    const trace_t* recs;
+    size_t n;
+    ull accesses = 0;
+    double start = now();
+
+    if (!reader || open_trace(config, reader) < 0) {
+        free(reader);
+        return -1;
+    }
+    while ((n = trace_next(reader, &recs)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            if (recs[i].op == 'I' && !config->icache && !config->prefetch && !config->pc_top) continue;
+            if (config->tlb && recs[i].op != 'I') translate(config, cache, recs[i].addr);
+            int hits = res->hit_count;
+            int outcome = simulate(&recs[i], cache, config, res);
+            if (config->attrib && recs[i].op != 'I') {
+                attrib_record(config->attrib, config->pc, recs[i].addr, cache_set_index(cache, recs[i].addr),
+                    res->hit_count - hits, outcome & ACCESS_MISS, outcome & ACCESS_EVICTION);
             }
-        case 'M':
-            // modify instruction, load and store.
-            {   
-                // load first;
-                bool found = false;
-                for(int i = 0; i < config->lines; ++i) {
-                    line = &(cache->sets[set_index].lines[i]);
-                    if (!line->valid) {
-                        // find a empty line, store data
-                        line->valid = true;
-                        line->tag = tag;
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found) {
-                    // eviction
-                    res->eviction_count++;
-                    line_t* newline = evict(&cache->sets[set_index]);
-                    newline->tag = tag;
-                    newline->valid = true;
-                } else {
-                    lru_move_to_head(&cache->sets[set_index], line);
-                }
-                
-                res->hit_count++;
-
-                if (config->verbose) {
-                    printf("M %llx,%d miss ", trace->addr, trace->size);
-                    if (found) {
-                        printf("hit\n");
-                    } else {
-                        printf("eviction hit\n");
-                    }
-                }
-                break;
+            // I records only train the prefetcher or set the PC without an I-cache
+            if (recs[i].op != 'I' || config->icache) accesses++;
+        }
+    }
+    bool failed = reader->error;
+    trace_close(reader);
+    free(reader);
+    if (failed) return -1;
+
+    if (config->stats) {
+        double elapsed = now() - start;
+        fprintf(stderr, "accesses: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+    return 0;
+}
+
+/**
+ * Buckets of the miss ratio curve: distances below MRC_STEPS have their
+ * own, every power of two above is split in MRC_STEPS equal parts.
+ */
+#define MRC_STEPS 4
+#define MRC_BUCKETS (MRC_STEPS + 62 * MRC_STEPS)
+
+static inline int mrc_bucket(ull d) {
+    if (d < MRC_STEPS) return d;
+    int k = 63 - __builtin_clzll(d);
+    return MRC_STEPS + (k - 2) * MRC_STEPS + (int)((d >> (k - 2)) & (MRC_STEPS - 1));
+}
+
+/**
+ * The smallest distance of bucket i.
+ */
+static inline ull mrc_bucket_start(int i) {
+    if (i < MRC_STEPS) return i;
+    int k = (i - MRC_STEPS) / MRC_STEPS + 2;
+    return (1ULL << k) | (ull)((i - MRC_STEPS) % MRC_STEPS) << (k - 2);
+}
+
+/**
+ * Print the miss ratio of a fully associative LRU cache for every bucket
+ * start up to the largest distance seen, using SHARDS: the reuse distances
+ * of the sampled blocks are scaled by the sampling rate. With a budget
+ * every rate drop scales the counts so far the same way, at a fixed rate
+ * the difference between the expected and the actual number of sampled
+ * accesses is counted as hits (SHARDS-adj).
+ */
+static int run_mrc(config_t* config) {
+    double hist[MRC_BUCKETS] = {0};
+    double cold = 0, total = 0;
+    shards_t shards;
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    double rate = config->shards_rate > 0 ? config->shards_rate : config->shards_budget ? 1 : SHARDS_RATE;
+    if (!reader || shards_init(&shards, rate, config->shards_budget) < 0) {
+        free(reader);
+        return -1;
+    }
+    if (open_trace(config, reader) < 0) return -1;
+
+    const trace_t* recs;
+    size_t n;
+    ull accesses = 0, sampled = 0;
+    double start = now();
+    rate = shards_rate(&shards);
+    while ((n = trace_next(reader, &recs)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            if (recs[i].op == 0 || recs[i].op == 'I') continue;
+            accesses++;
+            ull d;
+            if (!shards_access(&shards, recs[i].addr >> config->block_bits, &d)) continue;
+            sampled++;
+            total++;
+            if (d == REUSE_COLD) cold++;
+            else hist[mrc_bucket(d / rate)]++;
+            if (shards_rate(&shards) < rate) {
+                double scale = shards_rate(&shards) / rate;
+                for (int k = 0; k < MRC_BUCKETS; ++k) hist[k] *= scale;
+                cold *= scale;
+                total *= scale;
+                rate = shards_rate(&shards);
             }
-        default: break;
+        }
+    }
+    double elapsed = now() - start;
+    bool failed = reader->error;
+    trace_close(reader);
+    free(reader);
+    if (failed) return -1;
+
+    if (!config->shards_budget && accesses * rate > total) {
+        hist[0] += accesses * rate - total;
+        total = accesses * rate;
+    }
+    int last = MRC_BUCKETS - 1;
+    while (last > 0 && hist[last] == 0) --last;
+    printf("sampled blocks:%llu accesses:%llu/%llu rate:%g\n",
+        shards.reuse.blocks, sampled, accesses, rate);
+    if (rate < 1 && shards.reuse.blocks < SHARDS_MIN_BLOCKS) {
+        fprintf(stderr, "warning: only %llu blocks sampled, fewer than %d, the curve is mostly noise; "
+            "raise --shards-rate or --shards-budget\n", shards.reuse.blocks, SHARDS_MIN_BLOCKS);
+    }
+    printf("%14s %16s %10s\n", "blocks", "bytes", "miss-rate");
+    double misses = total;
+    for (int k = 0; k <= last + 1 && k < MRC_BUCKETS; ++k) {
+        misses -= hist[k];
+        ull blocks = mrc_bucket_start(k + 1 < MRC_BUCKETS ? k + 1 : k);
+        printf("%14llu %16llu %9.3f%%\n", blocks, blocks << config->block_bits,
+            total > 0 ? 100 * misses / total : 0.0);
+    }
+    if (config->stats) {
+        fprintf(stderr, "accesses: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+    shards_destroy(&shards);
+    return 0;
+}
+
+/**
+ * @brief results of one sampled set
+ */
+typedef struct {
+    ull hits;
+    ull misses;
+    ull evictions;
+} sample_set_t;
+
+/**
+ * Return the ordinal of set index among the sampled sets, or -1 when it
+ * is not sampled. The hash is a bijection of the set_bits bit indexes, the
+ * sets it maps below nsampled are the sample, every seed picks another.
+ */
+static inline long sample_ordinal(const config_t* config, ull index, ull nsampled) {
+    if (!config->sample_hash) return index % config->sample ? -1 : (long)(index / config->sample);
+    ull mask = config->sets - 1;
+    ull h = ((index ^ config->seed) * 0x9E3779B97F4A7C15ULL) & mask;
+    h ^= h >> (config->set_bits / 2 + 1);
+    h = (h * 0xBF58476D1CE4E5B9ULL) & mask;
+    return h < nsampled ? (long)h : -1;
+}
+
+/**
+ * Print the half width ci of a 95% confidence interval from n sampled
+ * sets of nsets: a census is exact, and neither a single set nor a
+ * systematic (every k-th set) sample tells the variance between sets.
+ */
+static void print_interval(const config_t* config, double ci, double n, double nsets, const char* unit) {
+    if (n >= nsets) printf(" exact");
+    else if (n < 2 || !config->sample_hash) printf(" +-n/a");
+    else printf(" +-%.*f%s", *unit ? 3 : 0, ci, unit);
+}
+
+/**
+ * Print the estimate of total, the sum of y over all sets, from its sum
+ * and sum of squares over the n sampled sets of nsets, and the half width
+ * of its 95% confidence interval.
+ */
+static void print_estimate(const config_t* config, const char* name, double sum, double sumsq,
+    double n, double nsets) {
+    double var = n > 1 ? (sumsq - sum * sum / n) / (n - 1) : 0;
+    double ci = 1.96 * nsets * sqrt((1 - n / nsets) * var / n);
+    printf("%s:%.0f", name, sum * nsets / n);
+    print_interval(config, ci, n, nsets, "");
+    printf(" ");
+}
+
+/**
+ * Simulate only the sampled sets, accesses to the other ones are dropped
+ * as soon as their index is known, and extrapolate the totals. The sampled
+ * sets are taken as a simple random sample of the sets, the miss rate is
+ * a ratio estimate over them.
+ */
+static int run_sampled(config_t* config, cache_t* cache) {
+    ull nsampled = config->sample_hash ? config->sets / config->sample
+        : (config->sets + config->sample - 1) / config->sample;
+    if (nsampled == 0) nsampled = 1;
+    sample_set_t* sampled = calloc(nsampled, sizeof(sample_set_t));
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!sampled || !reader) {
+        fprintf(stderr, "allocate sampled sets failed: %s\n", strerror(errno));
+        free(sampled);
+        free(reader);
+        return -1;
+    }
+    if (open_trace(config, reader) < 0) return -1;
+
+    const trace_t* recs;
+    size_t n;
+    ull accesses = 0, simulated = 0;
+    double start = now();
+    while ((n = trace_next(reader, &recs)) > 0) {
+        for (size_t i = 0; i < n; ++i) {
+            if (recs[i].op == 0 || recs[i].op == 'I') continue;
+            accesses++;
+            long ordinal = sample_ordinal(config, cache_set_index(cache, recs[i].addr), nsampled);
+            if (ordinal < 0) continue;
+            result_t res = {0, 0, 0};
+            simulate(&recs[i], cache, config, &res);
+            sampled[ordinal].hits += res.hit_count;
+            sampled[ordinal].misses += res.miss_count;
+            sampled[ordinal].evictions += res.eviction_count;
+            simulated++;
+        }
+    }
+    double elapsed = now() - start;
+    bool failed = reader->error;
+    trace_close(reader);
+    free(reader);
+    if (failed) return -1;
+
+    double sum[3] = {0}, sumsq[3] = {0}, miss_acc = 0;
+    for (ull i = 0; i < nsampled; ++i) {
+        double y[3] = {sampled[i].hits, sampled[i].misses, sampled[i].evictions};
+        for (int k = 0; k < 3; ++k) {
+            sum[k] += y[k];
+            sumsq[k] += y[k] * y[k];
+        }
+        miss_acc += y[1] * (y[0] + y[1]);
+    }
+    free(sampled);
+
+    double nsets = config->sets;
+    printSummary(llround(sum[0] * nsets / nsampled), llround(sum[1] * nsets / nsampled),
+        llround(sum[2] * nsets / nsampled));
+    printf("sampled sets:%llu/%llu accesses:%llu/%llu\n", nsampled, config->sets, simulated, accesses);
+    if (!config->sample_hash && nsampled < nsets) {
+        fprintf(stderr, "warning: every %llu-th set is not a random sample, strided accesses alias "
+            "with it; use --sample %llu,hash (and several --seed) for confidence intervals\n",
+            config->sample, config->sample);
+    }
+    print_estimate(config, "hits", sum[0], sumsq[0], nsampled, nsets);
+    print_estimate(config, "misses", sum[1], sumsq[1], nsampled, nsets);
+    print_estimate(config, "evictions", sum[2], sumsq[2], nsampled, nsets);
+    // ratio estimate: the residuals miss - rate * (hit + miss) of the sets
+    double acc = sum[0] + sum[1];
+    double rate = acc > 0 ? sum[1] / acc : 0;
+    double acc_sq = sumsq[0] + 2 * (miss_acc - sumsq[1]) + sumsq[1];
+    double resid = sumsq[1] - 2 * rate * miss_acc + rate * rate * acc_sq;
+    double mean = acc / nsampled;
+    double rate_ci = nsampled > 1 && mean > 0 ? 1.96 * sqrt((1 - nsampled / nsets)
+        * resid / (nsampled - 1) / nsampled) / mean : 0;
+    printf("miss-rate:%.3f%%", 100 * rate);
+    print_interval(config, 100 * rate_ci, nsampled, nsets, "%");
+    printf("\n");
+    if (config->stats) {
+        fprintf(stderr, "accesses: %llu, elapsed: %.3fs, accesses/sec: %.0f\n",
+            accesses, elapsed, elapsed > 0 ? accesses / elapsed : 0.0);
+    }
+    return 0;
+}
+
+/**
+ * One worker of a sweep. Worker i simulates geometries i, i + jobs, ...
+ * on every batch published by the reading thread.
+ */
+typedef struct {
+    int id;
+    int jobs;
+    size_t count;
+    config_t* configs;
+    cache_t* caches;
+    result_t* results;
+    const trace_t* volatile* recs;
+    volatile size_t* n;
+    pthread_barrier_t* batch_ready;
+    pthread_barrier_t* batch_done;
+} sweep_worker_t;
+
+static void sweep_batch(sweep_worker_t* w, const trace_t* recs, size_t n) {
+    for (size_t g = w->id; g < w->count; g += w->jobs) {
+        for (size_t i = 0; i < n; ++i) {
+            simulate(&recs[i], &w->caches[g], &w->configs[g], &w->results[g]);
+        }
+    }
+}
+
+static void* sweep_thread(void* arg) {
+    sweep_worker_t* w = arg;
+    for (;;) {
+        pthread_barrier_wait(w->batch_ready);
+        size_t n = *w->n;
+        if (n == 0) break;
+        sweep_batch(w, *w->recs, n);
+        pthread_barrier_wait(w->batch_done);
+    }
+    return NULL;
+}
+
+/**
+ * Simulate every geometry of config->sweep in a single pass over the trace
+ * and print a table of the results.
+ */
+static int run_sweep(config_t* config) {
+    size_t count = config->sweep_count;
+    int jobs = config->jobs > 0 ? config->jobs : 1;
+    if ((size_t)jobs > count) jobs = count;
+
+    config_t* configs = calloc(count, sizeof(config_t));
+    cache_t* caches = calloc(count, sizeof(cache_t));
+    result_t* results = calloc(count, sizeof(result_t));
+    sweep_worker_t* workers = calloc(jobs, sizeof(sweep_worker_t));
+    pthread_t* threads = calloc(jobs, sizeof(pthread_t));
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!configs || !caches || !results || !workers || !threads || !reader) {
+        fprintf(stderr, "allocate sweep failed: %s\n", strerror(errno));
+        return -1;
+    }
+    cache_opts_t opts = cache_options(config);
+    for (size_t g = 0; g < count; ++g) {
+        configs[g] = *config;
+        configs[g].sweep = NULL;
+        configs[g].sweep_count = 0;
+        configs[g].set_bits = config->sweep[g].set_bits;
+        configs[g].sets = 1ULL << configs[g].set_bits;
+        configs[g].lines = config->sweep[g].lines;
+        configs[g].block_bits = config->sweep[g].block_bits;
+        configs[g].block_size = 1ULL << configs[g].block_bits;
+        if (createCache(&caches[g], &config->sweep[g], &opts) < 0) return -1;
+    }
+    if (open_trace(config, reader) < 0) return -1;
+
+    const trace_t* volatile recs = NULL;
+    volatile size_t n = 0;
+    pthread_barrier_t batch_ready, batch_done;
+    pthread_barrier_init(&batch_ready, NULL, jobs);
+    pthread_barrier_init(&batch_done, NULL, jobs);
+    for (int i = 0; i < jobs; ++i) {
+        workers[i] = (sweep_worker_t){i, jobs, count, configs, caches, results,
+            &recs, &n, &batch_ready, &batch_done};
+        if (i > 0) pthread_create(&threads[i], NULL, sweep_thread, &workers[i]);
     }
-} 
 
-result_t run(config_t* config, cache_t* cache) {
-    result_t res = {0, 0, 0};
-    char buf[MAX_LEN] = {0};
+    ull accesses = 0;
+    double start = now();
+    for (;;) {
+        const trace_t* batch;
+        n = trace_next(reader, &batch);
+        recs = batch;
+        pthread_barrier_wait(&batch_ready);
+        if (n == 0) break;
+        sweep_batch(&workers[0], recs, n);
+        for (size_t i = 0; i < n; ++i) accesses += recs[i].op != 'I';
+        pthread_barrier_wait(&batch_done);
+    }
+    for (int i = 1; i < jobs; ++i) pthread_join(threads[i], NULL);
+    double elapsed = now() - start;
+    bool failed = reader->error;
 
-    while(fgets(buf, sizeof(buf), config->trace_file) != NULL) {
-        trace_t trace = parse_trace(buf);
-        simulate(&trace, cache, config, &res);
+    if (!failed) {
+        printf("%4s %6s %4s %12s %12s %12s %10s\n",
+            "s", "E", "b", "hits", "misses", "evictions", "miss-rate");
+    }
+    for (size_t g = 0; g < count; ++g) {
+        result_t* r = &results[g];
+        destroyCache(&caches[g]);
+        if (failed) continue;
+        double refs = (double)r->hit_count + r->miss_count;
+        printf("%4d %6ld %4d %12d %12d %12d %10.6f\n",
+            config->sweep[g].set_bits, config->sweep[g].lines, config->sweep[g].block_bits,
+            r->hit_count, r->miss_count, r->eviction_count,
+            refs > 0 ? r->miss_count / refs : 0.0);
+    }
+    if (config->stats) {
+        fprintf(stderr, "accesses: %llu, geometries: %zu, jobs: %d, elapsed: %.3fs, "
+            "accesses/sec: %.0f\n", accesses, count, jobs, elapsed,
+            elapsed > 0 ? accesses * (double)count / elapsed : 0.0);
     }
 
-    return res;
+    trace_close(reader);
+    pthread_barrier_destroy(&batch_ready);
+    pthread_barrier_destroy(&batch_done);
+    free(reader);
+    free(threads);
+    free(workers);
+    free(results);
+    free(caches);
+    free(configs);
+    return failed ? -1 : 0;
 }
 
 int main(int argc, char* argv[])
@@ -408,12 +2061,104 @@ int main(int argc, char* argv[])
     result_t result;
 
     memset(&config, 0, sizeof(config_t));
+    config.prefetch_latency = PREFETCH_LATENCY;
 
     if (parseOpt(argc, argv, &config) != 0) {
         usage();
         return 0;
     }
 
+    if ((config.nlevels > 0 || config.icache || config.prefetcher || config.victim)
+        && (config.max_lines > 0 || config.sweep_count > 0 || config.jobs > 1)) {
+        fprintf(stderr, "-L, --icache, --prefetch and --victim only work with a single cache, "
+            "without --stack-dist, --sweep or -j\n");
+        return -1;
+    }
+    if (config.tlb && (config.max_lines > 0 || config.sweep_count > 0 || config.jobs > 1
+        || config.reuse || config.mrc || config.sample)) {
+        fprintf(stderr, "--tlb only works with a single cache, without --stack-dist, "
+            "--sweep, --reuse, --mrc, --sample or -j\n");
+        return -1;
+    }
+    if (!config.tlb && (config.page_bits || config.page_walk)) {
+        fprintf(stderr, "--page-size and --page-walk need a --tlb\n");
+        return -1;
+    }
+    if (config.page_walk && config.victim) {
+        fprintf(stderr, "--page-walk does not work with --victim\n");
+        return -1;
+    }
+    if (config.victim && (config.prefetcher || config.sector_bits || config.write.no_allocate
+        || config.reuse || config.mrc || config.sample)) {
+        fprintf(stderr, "--victim does not work with --prefetch, --sector, nwa, --reuse, "
+            "--mrc or --sample\n");
+        return -1;
+    }
+    if (config.shadow && (config.max_lines > 0 || config.sweep_count > 0 || config.jobs > 1
+        || config.reuse || config.mrc || config.sample)) {
+        fprintf(stderr, "--3c only works with a single cache, without --stack-dist, "
+            "--sweep, --reuse, --mrc, --sample or -j\n");
+        return -1;
+    }
+    if ((config.attrib_top || config.pc_top) && (config.max_lines > 0 || config.sweep_count > 0 || config.jobs > 1
+        || config.reuse || config.mrc || config.sample)) {
+        fprintf(stderr, "--attrib, --heatmap and --pc only work with a single cache, without --stack-dist, "
+            "--sweep, --reuse, --mrc, --sample or -j\n");
+        return -1;
+    }
+    if (config.jobs > 1 && (config.reuse || config.mrc)) {
+        fprintf(stderr, "--reuse and --mrc do not work with -j\n");
+        return -1;
+    }
+    if (config.sample && (config.nlevels > 0 || config.icache || config.prefetcher
+        || config.max_lines > 0 || config.sweep_count > 0 || config.jobs > 1 || config.reuse)) {
+        fprintf(stderr, "--sample only works with a single cache, without -L, --icache, "
+            "--prefetch, --stack-dist, --sweep, --reuse or -j\n");
+        return -1;
+    }
+    if (config.sector_bits && (config.max_lines > 0 || config.sweep_count > 0 || config.prefetcher)) {
+        fprintf(stderr, "--sector does not work with --stack-dist, --sweep or --prefetch\n");
+        return -1;
+    }
+
+    if (config.reuse) {
+        if (config.block_size == 0 || config.trace_file == NULL || config.verbose) {
+            usage();
+            return -1;
+        }
+        if (config.interval == 0) config.interval = REUSE_INTERVAL;
+        return run_reuse(&config) < 0 ? -1 : 0;
+    }
+
+    if (config.mrc) {
+        if (config.block_size == 0 || config.trace_file == NULL || config.verbose) {
+            usage();
+            return -1;
+        }
+        return run_mrc(&config) < 0 ? -1 : 0;
+    }
+
+    if (config.max_lines > 0) {
+        if (config.policy && config.policy != find_policy("lru")) {
+            fprintf(stderr, "--stack-dist only models LRU\n");
+            return -1;
+        }
+        if (config.sets == 0 || config.block_size == 0
+            || config.trace_file == NULL || config.verbose) {
+            usage();
+            return -1;
+        }
+        return run_stack_dist(&config) < 0 ? -1 : 0;
+    }
+
+    if (config.sweep_count > 0) {
+        if (config.trace_file == NULL || config.verbose) {
+            usage();
+            return -1;
+        }
+        return run_sweep(&config) < 0 ? -1 : 0;
+    }
+
     if (config.lines == 0 
         || config.sets == 0
         || config.block_size == 0
@@ -422,11 +2167,47 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    if (createCache(&cache, &config) < 0) {
+    geometry_t geometry = {config.set_bits, config.lines, config.block_bits};
+    cache_opts_t opts = cache_options(&config);
+    opts.sector_bits = config.sector_bits;
+    if (createCache(&cache, &geometry, &opts) < 0 || setup_hierarchy(&config, &cache) < 0) {
         return -1;
     }
-    
-    result = run(&config, &cache);
+
+    if (config.sample) return run_sampled(&config, &cache) < 0 ? -1 : 0;
+    if (config.shadow) {
+        config.set_classes = calloc(config.sets, sizeof(miss_class_t));
+        if (!config.set_classes) {
+            fprintf(stderr, "allocate miss classes failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    if (config.attrib_top || config.pc_top) {
+        int flags = (config.attrib_top ? ATTRIB_BLOCKS : 0) | (config.pc_top ? ATTRIB_PCS : 0);
+        config.attrib = malloc(sizeof(attrib_t));
+        if (!config.attrib || attrib_create(config.attrib, flags, &geometry, config.heatmap,
+                config.interval ? config.interval : ATTRIB_WINDOW) < 0) return -1;
+    }
+
+    if (run(&config, &cache, &result) < 0) return -1;
     printSummary(result.hit_count, result.miss_count, result.eviction_count);
+    print_levels(&config, &result);
+    if (config.shadow) print_classes(&config, &result);
+    if (config.attrib) {
+        if (config.attrib_top) {
+            printf("\n");
+            attrib_report(config.attrib, stdout, config.attrib_top);
+        }
+        if (config.pc_top) {
+            if (!config.pc_addr2line) printf("\n");
+            attrib_report_pcs(config.attrib, stdout, config.pc_top, config.pc_addr2line);
+        }
+        attrib_destroy(config.attrib);
+        if (config.heatmap) fclose(config.heatmap);
+    }
+    if (config.prefetch) {
+        prefetch_destroy(config.prefetch);
+        free(config.prefetch);
+    }
     return 0;
 }
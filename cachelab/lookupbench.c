@@ -0,0 +1,135 @@
+/*
+ * lookupbench.c - Microbenchmark of the csim tag lookup on high
+ * associativity caches. Compares the original array-of-structs line
+ * layout against the tag arrays of cache.c, scalar and SIMD.
+ *
+ * usage: ./lookupbench [-s <s>] [-n <lookups>]
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "cache.h"
+
+/**
+ * The line layout csim used before the tag arrays.
+ */
+struct old_line {
+    bool valid;
+    struct old_line *prev, *next;
+    ull tag;
+    uint8_t* block;
+};
+
+typedef struct {
+    ull set;
+    const set_t* cache_set;
+    ull tag;
+} query_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static ull rand64(ull* state) {
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static long old_lookup(const struct old_line* lines, ull count, ull tag) {
+    for (ull i = 0; i < count; ++i) {
+        if (lines[i].valid && lines[i].tag == tag) return i;
+    }
+    return -1;
+}
+
+static void report(const char* name, ull lines, ull n, double elapsed, long sum) {
+    printf("%6llu %-8s %10.1f Mlookups/s  (checksum %ld)\n",
+        lines, name, n / elapsed / 1e6, sum);
+}
+
+int main(int argc, char* argv[]) {
+    int set_bits = 10;
+    ull n = 1 << 22;
+    int opt;
+    while ((opt = getopt(argc, argv, "hs:n:")) != -1) {
+        switch (opt) {
+            case 's':
+                set_bits = atoi(optarg);
+                break;
+            case 'n':
+                n = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                printf("./lookupbench [-s <s>] [-n <lookups>]\n");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    static const long assocs[] = {4, 8, 16, 32, 64};
+    ull state = 0x9E3779B97F4A7C15ULL;
+    query_t* queries = malloc(n * sizeof(query_t));
+    if (!queries) return 1;
+    bool avx2 = cpu_has_avx2();
+
+    printf("%6s %-8s %s\n", "E", "lookup", "throughput (half hits, half misses)");
+    for (size_t a = 0; a < sizeof(assocs) / sizeof(assocs[0]); ++a) {
+        geometry_t geometry = {set_bits, assocs[a], 6};
+        cache_t cache;
+        if (createCache(&cache, &geometry, NULL) < 0) return 1;
+        struct old_line* old = calloc(cache.nsets * cache.lines, sizeof(struct old_line));
+        if (!old) return 1;
+
+        for (ull s = 0; s < cache.nsets; ++s) {
+            set_t* set = cache_set(&cache, s);
+            if (!set) return 1;
+            for (ull l = 0; l < cache.lines; ++l) {
+                ull tag = rand64(&state) >> 16;
+                set->tags[l] = tag;
+                set->valid[l] = 1;
+                old[s * cache.lines + l].tag = tag;
+                old[s * cache.lines + l].valid = true;
+            }
+        }
+        for (ull i = 0; i < n; ++i) {
+            ull r = rand64(&state);
+            queries[i].set = r % cache.nsets;
+            queries[i].cache_set = cache_set(&cache, queries[i].set);
+            queries[i].tag = (r >> 32) & 1
+                ? queries[i].cache_set->tags[(r >> 40) % cache.lines]
+                : rand64(&state) >> 16;
+        }
+
+        long sum = 0;
+        double t = now();
+        for (ull i = 0; i < n; ++i) {
+            sum += old_lookup(&old[queries[i].set * cache.lines], cache.lines, queries[i].tag);
+        }
+        report("aos", cache.lines, n, now() - t, sum);
+
+        tag_match_fn fns[] = {tag_match_scalar, tag_match_sse2, tag_match_avx2};
+        const char* names[] = {"scalar", "sse2", "avx2"};
+        for (int f = 0; f < (avx2 ? 3 : 2); ++f) {
+            sum = 0;
+            t = now();
+            for (ull i = 0; i < n; ++i) {
+                const set_t* set = queries[i].cache_set;
+                sum += fns[f](set->tags, set->valid, cache.lines, queries[i].tag);
+            }
+            report(names[f], cache.lines, n, now() - t, sum);
+        }
+
+        free(old);
+        destroyCache(&cache);
+    }
+    free(queries);
+    return 0;
+}
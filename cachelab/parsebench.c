@@ -0,0 +1,138 @@
+/*
+ * parsebench.c - Microbenchmark of the trace line parsers. Compares
+ * fgets + parse_trace, the parser of the stdio path before the line
+ * decoders, against the scalar and SIMD decoders of trace.c, and checks
+ * that every decoder gives the records of the scalar one.
+ *
+ * usage: ./parsebench [-r <rounds>] <tracefile>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "trace.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static ull checksum(const trace_t* recs, size_t n) {
+    ull sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum = sum * 31 + (recs[i].addr ^ (ull)recs[i].op << 56 ^ (ull)recs[i].size << 40);
+    }
+    return sum;
+}
+
+static void report(const char* name, ull lines, size_t bytes, double elapsed, ull records, ull sum) {
+    printf("%-8s %8.1f Mlines/s %8.1f MB/s  (%llu records, checksum %016llx)\n",
+        name, lines / elapsed / 1e6, bytes / elapsed / 1e6, records, sum);
+}
+
+/**
+ * Decode all of text with fn, compare the records to expect when given.
+ */
+static size_t decode_all(trace_decode_fn fn, const char* text, size_t len, trace_t* out,
+    const trace_t* expect, const char* name) {
+    const char* p = text;
+    const char* end = text + len;
+    size_t n = 0;
+    while (p < end) {
+        n += fn(p, end, out + n, TRACE_BATCH, &p);
+    }
+    if (expect && memcmp(out, expect, n * sizeof(trace_t)) != 0) {
+        for (size_t i = 0; i < n; ++i) {
+            if (memcmp(&out[i], &expect[i], sizeof(trace_t)) == 0) continue;
+            fprintf(stderr, "%s: record %zu differs: %c %llx,%d instead of %c %llx,%d\n",
+                name, i, out[i].op, out[i].addr, out[i].size,
+                expect[i].op, expect[i].addr, expect[i].size);
+            break;
+        }
+        exit(1);
+    }
+    return n;
+}
+
+int main(int argc, char* argv[]) {
+    int rounds = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "hr:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                printf("./parsebench [-r <rounds>] <tracefile>\n");
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        printf("./parsebench [-r <rounds>] <tracefile>\n");
+        return 1;
+    }
+    FILE* file = fopen(argv[optind], "r");
+    if (!file) {
+        perror(argv[optind]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    rewind(file);
+    char* text = malloc(len + 1);
+    if (!text || fread(text, 1, len, file) != len) return 1;
+    fclose(file);
+
+    ull lines = 0;
+    for (size_t i = 0; i < len; ++i) lines += text[i] == '\n';
+    // a record per 4 bytes at most, see TRACE_MIN_LINE
+    trace_t* expect = malloc((len / 4 + 1) * sizeof(trace_t));
+    trace_t* out = malloc((len / 4 + 1) * sizeof(trace_t));
+    if (!expect || !out) return 1;
+    size_t records = decode_all(trace_decode_scalar, text, len, expect, NULL, "scalar");
+
+    printf("%llu lines, %zu bytes, best of %d rounds\n", lines, len, rounds);
+    double best = 1e30;
+    ull sum = 0, n = 0;
+    for (int r = 0; r < rounds; ++r) {
+        FILE* in = fmemopen(text, len, "r");
+        if (!in) return 1;
+        char buf[MAX_LEN];
+        n = 0;
+        double t = now();
+        while (fgets(buf, sizeof(buf), in) != NULL) {
+            trace_t rec = parse_trace(buf);
+            if (rec.op) out[n++] = rec;
+        }
+        t = now() - t;
+        fclose(in);
+        if (t < best) best = t;
+    }
+    sum = checksum(out, n);
+    report("fgets", lines, len, best, n, sum);
+
+    __builtin_cpu_init();
+    trace_decode_fn fns[] = {trace_decode_scalar, trace_decode_sse42, trace_decode_avx2};
+    const char* names[] = {"scalar", "sse4.2", "avx2"};
+    bool supported[] = {true, __builtin_cpu_supports("sse4.2"), __builtin_cpu_supports("avx2")};
+    for (int f = 0; f < 3; ++f) {
+        if (!supported[f]) continue;
+        best = 1e30;
+        for (int r = 0; r < rounds; ++r) {
+            double t = now();
+            n = decode_all(fns[f], text, len, out, expect, names[f]);
+            t = now() - t;
+            if (t < best) best = t;
+        }
+        report(names[f], lines, len, best, n, checksum(out, n));
+    }
+    if (records != n) fprintf(stderr, "record counts differ\n");
+    free(text);
+    free(expect);
+    free(out);
+    return 0;
+}
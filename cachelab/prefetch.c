@@ -0,0 +1,280 @@
+/*
+ * prefetch.c - Hardware prefetcher models.
+ */
+#include "prefetch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * Tagged next-line prefetching: a miss or the first use of a prefetched
+ * block fetches the degree blocks after it.
+ */
+static int next_line_train(prefetch_t* pf, ull pc, ull addr, int event, ull* out) {
+    if (!event) return 0;
+    ull block = addr >> pf->block_bits;
+    for (int i = 0; i < pf->degree; ++i) out[i] = block + 1 + i;
+    return pf->degree;
+}
+
+/**
+ * Stream table: misses within STREAM_WINDOW blocks of the last miss of a
+ * stream extend it, two steps in the same direction confirm it and every
+ * further one prefetches the degree blocks ahead.
+ */
+#define STREAMS 16
+#define STREAM_WINDOW 16
+
+typedef struct {
+    ull last; /**< last block of the stream */
+    int dir;
+    int confidence;
+    ull used;
+} stream_t;
+
+typedef struct {
+    stream_t streams[STREAMS];
+    ull clock;
+} stream_table_t;
+
+static int stream_detect(prefetch_t* pf, stream_table_t* table, ull block, ull* out) {
+    stream_t* stream = NULL;
+    stream_t* lru = &table->streams[0];
+    table->clock++;
+    for (int i = 0; i < STREAMS; ++i) {
+        stream_t* s = &table->streams[i];
+        if (s->used && block - s->last + STREAM_WINDOW <= 2 * STREAM_WINDOW) {
+            stream = s;
+            break;
+        }
+        if (s->used < lru->used) lru = s;
+    }
+    if (!stream) {
+        *lru = (stream_t){block, 0, 0, table->clock};
+        return 0;
+    }
+    stream->used = table->clock;
+    if (block == stream->last) return 0;
+    int dir = block > stream->last ? 1 : -1;
+    if (dir == stream->dir) {
+        if (stream->confidence < 3) stream->confidence++;
+    } else {
+        stream->dir = dir;
+        stream->confidence = 1;
+    }
+    stream->last = block;
+    if (stream->confidence < 2) return 0;
+
+    int n = 0;
+    for (int i = 1; i <= pf->degree; ++i) {
+        if (dir < 0 && block < (ull)i) break;
+        out[n++] = dir > 0 ? block + i : block - i;
+    }
+    return n;
+}
+
+static int stream_train(prefetch_t* pf, ull pc, ull addr, int event, ull* out) {
+    if (!event) return 0;
+    return stream_detect(pf, pf->state, addr >> pf->block_bits, out);
+}
+
+/**
+ * Per-PC stride prefetching with a reference prediction table (Chen and
+ * Baer). An entry learns the stride between the accesses of one
+ * instruction, once the same stride was seen twice in a row it prefetches
+ * the blocks of the next degree strides. Without I records there is no PC
+ * to go by, the misses train a stream table instead.
+ */
+#define RPT_ENTRIES 256
+
+typedef struct {
+    ull pc;
+    ull last;
+    long long stride;
+    int confidence;
+} rpt_entry_t;
+
+typedef struct {
+    rpt_entry_t rpt[RPT_ENTRIES];
+    stream_table_t streams;
+} stride_t;
+
+static int stride_train(prefetch_t* pf, ull pc, ull addr, int event, ull* out) {
+    stride_t* st = pf->state;
+    if (pc == 0) return event ? stream_detect(pf, &st->streams, addr >> pf->block_bits, out) : 0;
+
+    rpt_entry_t* e = &st->rpt[((pc >> 2) ^ (pc >> 10)) & (RPT_ENTRIES - 1)];
+    if (e->pc != pc) {
+        *e = (rpt_entry_t){pc, addr, 0, 0};
+        return 0;
+    }
+    long long delta = addr - e->last;
+    e->last = addr;
+    if (delta == e->stride) {
+        if (e->confidence < 3) e->confidence++;
+    } else {
+        e->stride = delta;
+        e->confidence = 0;
+    }
+    if (e->confidence < 2 || delta == 0) return 0;
+
+    int n = 0;
+    ull block = addr >> pf->block_bits;
+    ull next = addr;
+    for (int i = 0; i < pf->degree; ++i) {
+        next += delta;
+        ull b = next >> pf->block_bits;
+        // small strides reach the same block several times
+        if (b != block && (n == 0 || out[n - 1] != b)) out[n++] = b;
+    }
+    return n;
+}
+
+/**
+ * Stream buffers (Jouppi, ISCA 1990): STREAM_BUFFERS FIFOs of degree
+ * blocks beside the cache. A miss that finds its block in a buffer takes
+ * it from there, dropping the blocks before it, and the buffer fetches
+ * ahead again. Any other miss flushes the least recently used buffer and
+ * restarts it on the blocks after the miss.
+ */
+#define STREAM_BUFFERS 4
+
+typedef struct {
+    ull blocks[PREFETCH_MAX_DEGREE];
+    int head;
+    int count;
+    ull next; /**< next block to fetch */
+    ull used;
+} stream_buffer_t;
+
+typedef struct {
+    stream_buffer_t buffers[STREAM_BUFFERS];
+    ull clock;
+    stream_buffer_t* hit; /**< the buffer the last lookup found its block in */
+} stream_buffers_t;
+
+static bool streambuf_lookup(prefetch_t* pf, ull block) {
+    stream_buffers_t* sb = pf->state;
+    sb->hit = NULL;
+    for (int i = 0; i < STREAM_BUFFERS; ++i) {
+        stream_buffer_t* buf = &sb->buffers[i];
+        for (int j = 0; j < buf->count; ++j) {
+            if (buf->blocks[(buf->head + j) % pf->degree] != block) continue;
+            pf->useless += j;
+            buf->head = (buf->head + j + 1) % pf->degree;
+            buf->count -= j + 1;
+            buf->used = ++sb->clock;
+            sb->hit = buf;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int streambuf_train(prefetch_t* pf, ull pc, ull addr, int event, ull* out) {
+    stream_buffers_t* sb = pf->state;
+    if (!(event & PREFETCH_MISS)) return 0;
+    stream_buffer_t* buf = sb->hit;
+    if (!(event & PREFETCH_HIT) || !buf) {
+        buf = &sb->buffers[0];
+        for (int i = 1; i < STREAM_BUFFERS; ++i) {
+            if (sb->buffers[i].used < buf->used) buf = &sb->buffers[i];
+        }
+        pf->useless += buf->count;
+        buf->head = buf->count = 0;
+        buf->next = (addr >> pf->block_bits) + 1;
+        buf->used = ++sb->clock;
+    }
+    int n = 0;
+    while (buf->count < pf->degree) {
+        buf->blocks[(buf->head + buf->count++) % pf->degree] = buf->next;
+        out[n++] = buf->next++;
+    }
+    sb->hit = NULL;
+    return n;
+}
+
+static const prefetcher_t prefetchers[] = {
+    {"next-line", 1, 0, next_line_train, NULL},
+    {"stride", 2, sizeof(stride_t), stride_train, NULL},
+    {"stream", 2, sizeof(stream_table_t), stream_train, NULL},
+    {"streambuf", 4, sizeof(stream_buffers_t), streambuf_train, streambuf_lookup},
+};
+
+const prefetcher_t* find_prefetcher(const char* name) {
+    for (size_t i = 0; i < sizeof(prefetchers) / sizeof(prefetchers[0]); ++i) {
+        if (strcmp(prefetchers[i].name, name) == 0) return &prefetchers[i];
+    }
+    return NULL;
+}
+
+void print_prefetchers(FILE* out, const char* sep) {
+    for (size_t i = 0; i < sizeof(prefetchers) / sizeof(prefetchers[0]); ++i) {
+        fprintf(out, "%s%s", i ? sep : "", prefetchers[i].name);
+    }
+}
+
+int prefetch_create(prefetch_t* pf, const prefetcher_t* kind, int degree, ull latency,
+    const geometry_t* geometry, const cache_opts_t* opts) {
+    if (!pf || !kind) return -1;
+    memset(pf, 0, sizeof(*pf));
+    pf->kind = kind;
+    pf->degree = degree > 0 ? degree : kind->degree;
+    pf->block_bits = geometry->block_bits;
+    pf->latency = latency;
+    if (pf->degree > PREFETCH_MAX_DEGREE) {
+        fprintf(stderr, "prefetch degree should be at most %d\n", PREFETCH_MAX_DEGREE);
+        return -1;
+    }
+    pf->state = calloc(1, kind->state_size ? kind->state_size : 1);
+    if (!pf->state) {
+        fprintf(stderr, "allocate prefetcher failed: %s\n", strerror(errno));
+        return -2;
+    }
+    // the inflight ring starts out empty, not holding block 0
+    for (int i = 0; i < PREFETCH_INFLIGHT; ++i) pf->inflight[i].block = ~0ULL;
+    return createCache(&pf->baseline, geometry, opts);
+}
+
+void prefetch_destroy(prefetch_t* pf) {
+    if (!pf) return;
+    destroyCache(&pf->baseline);
+    free(pf->state);
+    pf->state = NULL;
+}
+
+void prefetch_issued(prefetch_t* pf, ull block) {
+    pf->inflight[pf->issued % PREFETCH_INFLIGHT].block = block;
+    pf->inflight[pf->issued % PREFETCH_INFLIGHT].tick = pf->tick;
+    pf->issued++;
+}
+
+void prefetch_used(prefetch_t* pf, ull block) {
+    pf->useful++;
+    // look for the latest prefetch of block still in the ring
+    for (ull i = 1; i <= PREFETCH_INFLIGHT && i <= pf->issued; ++i) {
+        const ull slot = (pf->issued - i) % PREFETCH_INFLIGHT;
+        if (pf->inflight[slot].block != block) continue;
+        if (pf->tick - pf->inflight[slot].tick < pf->latency) pf->late++;
+        return;
+    }
+}
+
+void prefetch_baseline(prefetch_t* pf, ull addr, bool allocate) {
+    cache_t* cache = &pf->baseline;
+    ull index = cache_set_index(cache, addr);
+    set_t* set = cache_set(cache, index);
+    if (!set) return;
+    ull tag = cache_tag(cache, addr);
+    long line = cache_find(cache, set, tag);
+    if (line >= 0) {
+        cache_touch(cache, set, line);
+        return;
+    }
+    pf->baseline_misses++;
+    if (!allocate) return;
+    line = find_a_empty_line(cache, set);
+    if (line < 0) line = evict(cache, set, NULL);
+    cache_fill(cache, set, line, tag);
+}
@@ -0,0 +1,100 @@
+/*
+ * prefetch.h - Hardware prefetcher models trained on the demand accesses
+ * of the simulated data cache.
+ */
+
+#ifndef CSIM_PREFETCH_H
+#define CSIM_PREFETCH_H
+
+#include "cache.h"
+
+#define PREFETCH_MAX_DEGREE 16
+#define PREFETCH_INFLIGHT 256
+#define PREFETCH_LATENCY 8
+
+/**
+ * What a demand access told the prefetcher, 0 for a plain hit.
+ */
+enum {
+    PREFETCH_MISS = 1, /**< the access missed in the cache */
+    PREFETCH_HIT = 2, /**< the access used a prefetched block */
+};
+
+typedef struct prefetch prefetch_t;
+
+/**
+ * @brief a prefetcher model
+ *
+ * train sees every demand access, pc is the address of the last I record
+ * (0 without I records), and writes the blocks (addresses >> block bits)
+ * it wants prefetched to out. Blocks go into the cache, unless the model
+ * keeps them in its own buffers: then lookup takes a block out of them on
+ * a demand miss.
+ */
+typedef struct {
+    const char* name;
+    int degree; /**< default blocks per trigger */
+    size_t state_size;
+    int (*train)(prefetch_t* pf, ull pc, ull addr, int event, ull* out);
+    bool (*lookup)(prefetch_t* pf, ull block); /**< NULL when prefetching into the cache */
+} prefetcher_t;
+
+/**
+ * Return the prefetcher called name (next-line, stride, stream,
+ * streambuf) or NULL.
+ */
+const prefetcher_t* find_prefetcher(const char* name);
+
+/**
+ * Print the names of all prefetchers separated by sep.
+ */
+void print_prefetchers(FILE* out, const char* sep);
+
+/**
+ * @brief a prefetcher attached to a cache and its statistics
+ */
+struct prefetch {
+    const prefetcher_t* kind;
+    int degree; /**< blocks per trigger, the depth of a stream buffer */
+    int block_bits;
+    ull latency; /**< demand accesses a prefetch takes to arrive */
+    void* state;
+    ull tick; /**< demand accesses so far */
+    struct {
+        ull block;
+        ull tick;
+    } inflight[PREFETCH_INFLIGHT]; /**< the last prefetches issued */
+
+    ull issued;
+    ull useful; /**< prefetched blocks used by a demand access */
+    ull late; /**< useful prefetches used before they arrived */
+    ull useless; /**< prefetched blocks evicted or dropped unused */
+    ull demand_misses; /**< misses a stream buffer could not serve */
+    cache_t baseline; /**< the same cache without prefetching */
+    ull baseline_misses;
+};
+
+/**
+ * Set up pf for a cache of geometry, degree 0 picks the default of kind.
+ */
+int prefetch_create(prefetch_t* pf, const prefetcher_t* kind, int degree, ull latency,
+    const geometry_t* geometry, const cache_opts_t* opts);
+void prefetch_destroy(prefetch_t* pf);
+
+/**
+ * Record that block was prefetched now.
+ */
+void prefetch_issued(prefetch_t* pf, ull block);
+
+/**
+ * Record that a demand access used the prefetched block.
+ */
+void prefetch_used(prefetch_t* pf, ull block);
+
+/**
+ * Replay a demand access of addr in the baseline cache, allocate is false
+ * for a store miss that does not fill a line.
+ */
+void prefetch_baseline(prefetch_t* pf, ull addr, bool allocate);
+
+#endif /* CSIM_PREFETCH_H */
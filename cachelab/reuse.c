@@ -0,0 +1,236 @@
+/*
+ * reuse.c - Reuse distances with a Fenwick tree over access times.
+ */
+#include "reuse.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define REUSE_MIN_CAPACITY (1ULL << 16)
+#define REUSE_MIN_TABLE (1ULL << 12)
+
+static inline ull hash_block(ull block) {
+    block ^= block >> 33;
+    block *= 0xFF51AFD7ED558CCDULL;
+    block ^= block >> 33;
+    return block;
+}
+
+static reuse_entry_t* new_table(ull size) {
+    reuse_entry_t* table = malloc(size * sizeof(reuse_entry_t));
+    if (!table) {
+        fprintf(stderr, "allocate reuse table failed: %s\n", strerror(errno));
+        return NULL;
+    }
+    for (ull i = 0; i < size; ++i) table[i].time = REUSE_COLD;
+    return table;
+}
+
+/**
+ * Rebuild the tree for times 0..blocks - 1 all in use.
+ */
+static int build_tree(reuse_t* reuse, ull capacity) {
+    uint32_t* tree = realloc(reuse->tree, (capacity + 1) * sizeof(uint32_t));
+    if (!tree) {
+        fprintf(stderr, "allocate reuse tree failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for (ull i = 1; i <= capacity; ++i) tree[i] = i <= reuse->blocks;
+    for (ull i = 1; i <= capacity; ++i) {
+        ull j = i + (i & -i);
+        if (j <= capacity) tree[j] += tree[i];
+    }
+    reuse->tree = tree;
+    reuse->capacity = capacity;
+    return 0;
+}
+
+int reuse_init(reuse_t* reuse) {
+    memset(reuse, 0, sizeof(*reuse));
+    reuse->table_size = REUSE_MIN_TABLE;
+    reuse->table = new_table(reuse->table_size);
+    if (!reuse->table || build_tree(reuse, REUSE_MIN_CAPACITY) < 0) return -1;
+    return 0;
+}
+
+void reuse_destroy(reuse_t* reuse) {
+    free(reuse->table);
+    free(reuse->tree);
+    reuse->table = NULL;
+    reuse->tree = NULL;
+}
+
+static inline void tree_add(reuse_t* reuse, ull time, int delta) {
+    for (ull i = time + 1; i <= reuse->capacity; i += i & -i) reuse->tree[i] += delta;
+}
+
+/**
+ * Number of blocks last accessed at or before time.
+ */
+static inline ull tree_prefix(const reuse_t* reuse, ull time) {
+    ull sum = 0;
+    for (ull i = time + 1; i > 0; i -= i & -i) sum += reuse->tree[i];
+    return sum;
+}
+
+static int by_time(const void* a, const void* b) {
+    ull x = (*(reuse_entry_t* const*)a)->time;
+    ull y = (*(reuse_entry_t* const*)b)->time;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Renumber the last access times 0..blocks - 1 keeping their order, and
+ * size the tree for twice as many blocks.
+ */
+static int compact(reuse_t* reuse) {
+    reuse_entry_t** order = malloc((reuse->blocks + 1) * sizeof(reuse_entry_t*));
+    if (!order) {
+        fprintf(stderr, "allocate reuse compaction failed: %s\n", strerror(errno));
+        return -1;
+    }
+    ull n = 0;
+    for (ull i = 0; i < reuse->table_size; ++i) {
+        if (reuse->table[i].time != REUSE_COLD) order[n++] = &reuse->table[i];
+    }
+    qsort(order, n, sizeof(reuse_entry_t*), by_time);
+    for (ull i = 0; i < n; ++i) order[i]->time = i;
+    free(order);
+
+    reuse->now = n;
+    ull capacity = 2 * n > REUSE_MIN_CAPACITY ? 2 * n : REUSE_MIN_CAPACITY;
+    return build_tree(reuse, capacity);
+}
+
+static int grow_table(reuse_t* reuse) {
+    ull size = reuse->table_size * 2;
+    reuse_entry_t* table = new_table(size);
+    if (!table) return -1;
+    for (ull i = 0; i < reuse->table_size; ++i) {
+        const reuse_entry_t* e = &reuse->table[i];
+        if (e->time == REUSE_COLD) continue;
+        ull j = hash_block(e->block) & (size - 1);
+        while (table[j].time != REUSE_COLD) j = (j + 1) & (size - 1);
+        table[j] = *e;
+    }
+    free(reuse->table);
+    reuse->table = table;
+    reuse->table_size = size;
+    return 0;
+}
+
+static inline reuse_entry_t* find_slot(const reuse_t* reuse, ull block) {
+    ull mask = reuse->table_size - 1;
+    ull i = hash_block(block) & mask;
+    while (reuse->table[i].time != REUSE_COLD && reuse->table[i].block != block) i = (i + 1) & mask;
+    return &reuse->table[i];
+}
+
+ull reuse_access(reuse_t* reuse, ull block) {
+    if (reuse->now == reuse->capacity && compact(reuse) < 0) return REUSE_COLD;
+    if (2 * (reuse->blocks + 1) > reuse->table_size && grow_table(reuse) < 0) return REUSE_COLD;
+
+    reuse_entry_t* e = find_slot(reuse, block);
+    ull distance = REUSE_COLD;
+    if (e->time != REUSE_COLD) {
+        // every block last accessed after this one is in between
+        distance = reuse->blocks - tree_prefix(reuse, e->time);
+        tree_add(reuse, e->time, -1);
+    } else {
+        e->block = block;
+        reuse->blocks++;
+    }
+    e->time = reuse->now++;
+    tree_add(reuse, e->time, 1);
+    return distance;
+}
+
+void reuse_remove(reuse_t* reuse, ull block) {
+    reuse_entry_t* e = find_slot(reuse, block);
+    if (e->time == REUSE_COLD) return;
+    tree_add(reuse, e->time, -1);
+    reuse->blocks--;
+
+    // backward shift deletion keeps every probe sequence unbroken
+    ull mask = reuse->table_size - 1;
+    ull hole = e - reuse->table;
+    for (ull i = (hole + 1) & mask; reuse->table[i].time != REUSE_COLD; i = (i + 1) & mask) {
+        ull home = hash_block(reuse->table[i].block) & mask;
+        // move the entry unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            reuse->table[hole] = reuse->table[i];
+            hole = i;
+        }
+    }
+    reuse->table[hole].time = REUSE_COLD;
+}
+
+/**
+ * Independent of hash_block: the sampled blocks must still spread over
+ * the whole table.
+ */
+static inline ull shards_hash(ull block) {
+    block ^= block >> 31;
+    block *= 0x9E3779B97F4A7C15ULL;
+    return block >> 40;
+}
+
+int shards_init(shards_t* shards, double rate, ull budget) {
+    memset(shards, 0, sizeof(*shards));
+    shards->threshold = rate * SHARDS_MODULUS;
+    if (shards->threshold == 0) shards->threshold = 1;
+    if (shards->threshold > SHARDS_MODULUS) shards->threshold = SHARDS_MODULUS;
+    shards->budget = budget;
+    if (budget) {
+        shards->heap = malloc((budget + 1) * sizeof(shards_entry_t));
+        if (!shards->heap) {
+            fprintf(stderr, "allocate shards heap failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return reuse_init(&shards->reuse);
+}
+
+void shards_destroy(shards_t* shards) {
+    reuse_destroy(&shards->reuse);
+    free(shards->heap);
+    shards->heap = NULL;
+}
+
+static void heap_push(shards_t* shards, shards_entry_t e) {
+    shards_entry_t* heap = shards->heap;
+    ull i = shards->heap_size++;
+    for (; i > 0 && heap[(i - 1) / 2].hash < e.hash; i = (i - 1) / 2) heap[i] = heap[(i - 1) / 2];
+    heap[i] = e;
+}
+
+static shards_entry_t heap_pop(shards_t* shards) {
+    shards_entry_t* heap = shards->heap;
+    shards_entry_t top = heap[0];
+    shards_entry_t last = heap[--shards->heap_size];
+    ull n = shards->heap_size, i = 0;
+    for (ull child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && heap[child + 1].hash > heap[child].hash) child++;
+        if (heap[child].hash <= last.hash) break;
+        heap[i] = heap[child];
+    }
+    if (n > 0) heap[i] = last;
+    return top;
+}
+
+bool shards_access(shards_t* shards, ull block, ull* distance) {
+    ull hash = shards_hash(block);
+    if (hash >= shards->threshold) return false;
+    *distance = reuse_access(&shards->reuse, block);
+    if (!shards->budget || *distance != REUSE_COLD) return true;
+
+    heap_push(shards, (shards_entry_t){hash, block});
+    if (shards->heap_size <= shards->budget) return true;
+    // over budget: stop sampling the largest hash and every block sharing it
+    shards->threshold = shards->heap[0].hash;
+    while (shards->heap_size > 0 && shards->heap[0].hash >= shards->threshold) {
+        reuse_remove(&shards->reuse, heap_pop(shards).block);
+    }
+    return true;
+}
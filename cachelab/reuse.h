@@ -0,0 +1,99 @@
+/*
+ * reuse.h - Reuse distances (distinct blocks between two accesses of a
+ * block) of a stream of block accesses, in O(log n) per access.
+ */
+
+#ifndef CSIM_REUSE_H
+#define CSIM_REUSE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "trace.h"
+
+#define REUSE_COLD (~0ULL)
+
+typedef struct {
+    ull block;
+    ull time; /**< of the last access, REUSE_COLD for an empty slot */
+} reuse_entry_t;
+
+/**
+ * @brief reuse distance engine
+ *
+ * Every block remembers the time of its last access, a Fenwick tree over
+ * the times counts how many blocks were last accessed after it. Times are
+ * renumbered once the tree is full, so memory stays proportional to the
+ * number of distinct blocks and not to the length of the trace.
+ */
+typedef struct {
+    reuse_entry_t* table; /**< open addressing, block -> last access time */
+    ull table_size; /**< a power of two */
+    ull blocks; /**< distinct blocks in table */
+    uint32_t* tree; /**< Fenwick tree, 1 at the last access time of every block */
+    ull capacity; /**< times the tree can hold before a compaction */
+    ull now; /**< next time */
+} reuse_t;
+
+int reuse_init(reuse_t* reuse);
+void reuse_destroy(reuse_t* reuse);
+
+/**
+ * Access block, return its reuse distance or REUSE_COLD for a first access.
+ */
+ull reuse_access(reuse_t* reuse, ull block);
+
+/**
+ * Forget block as if it was never accessed, e.g. when a sampler drops it.
+ */
+void reuse_remove(reuse_t* reuse, ull block);
+
+/**
+ * Return the index of the log2 bucket of distance d: 0 for 0, 1 for 1,
+ * 2 for 2-3, 3 for 4-7...
+ */
+static inline int reuse_bucket(ull d) {
+    return d == 0 ? 0 : 64 - __builtin_clzll(d);
+}
+
+/**
+ * Sampled blocks hash to [0, SHARDS_MODULUS), the ones below the
+ * threshold are sampled.
+ */
+#define SHARDS_MODULUS (1ULL << 24)
+
+typedef struct {
+    ull hash;
+    ull block;
+} shards_entry_t;
+
+/**
+ * @brief SHARDS spatial sampling (Waldspurger et al., FAST 2015)
+ *
+ * Only the blocks whose hash is below the threshold are tracked, a
+ * sampled distance d stands for d / rate blocks of the full trace. With a
+ * budget, the threshold starts at the given rate and drops to the hash of
+ * the largest sampled block whenever more than budget blocks are sampled,
+ * so memory stays bounded whatever the trace.
+ */
+typedef struct {
+    reuse_t reuse;
+    ull threshold;
+    ull budget; /**< most blocks sampled at once, 0 for a fixed rate */
+    shards_entry_t* heap; /**< max-heap of the hashes of the sampled blocks */
+    ull heap_size;
+} shards_t;
+
+int shards_init(shards_t* shards, double rate, ull budget);
+void shards_destroy(shards_t* shards);
+
+static inline double shards_rate(const shards_t* shards) {
+    return (double)shards->threshold / SHARDS_MODULUS;
+}
+
+/**
+ * Access block, return false if it is not sampled. Otherwise *distance
+ * gets its reuse distance among the sampled blocks or REUSE_COLD.
+ */
+bool shards_access(shards_t* shards, ull block, ull* distance);
+
+#endif /* CSIM_REUSE_H */
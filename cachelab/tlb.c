@@ -0,0 +1,101 @@
+/*
+ * tlb.c - Translation lookaside buffers and page walks.
+ */
+#include "tlb.h"
+#include <stdio.h>
+#include <string.h>
+
+int tlb_add_level(tlb_t* tlb, long entries, long ways) {
+    if (tlb->nlevels == TLB_MAX_LEVELS) {
+        fprintf(stderr, "At most %d TLB levels are supported\n", TLB_MAX_LEVELS);
+        return -1;
+    }
+    if (entries <= 0 || ways <= 0 || ways > MAX_LINES || entries % ways != 0) {
+        fprintf(stderr, "A TLB should have a positive multiple of its ways entries\n");
+        return -1;
+    }
+    long sets = entries / ways;
+    if ((sets & (sets - 1)) != 0) {
+        fprintf(stderr, "The number of TLB sets (entries / ways) should be a power of two\n");
+        return -1;
+    }
+    tlb_level_t* level = &tlb->levels[tlb->nlevels++];
+    memset(level, 0, sizeof(*level));
+    level->entries = entries;
+    level->ways = ways;
+    return 0;
+}
+
+int tlb_create(tlb_t* tlb, int page_bits) {
+    if ((page_bits - PAGE_BITS) % WALK_LEVEL_BITS != 0 || page_bits < PAGE_BITS
+        || page_bits > WALK_ROOT_SHIFT - WALK_LEVEL_BITS) {
+        fprintf(stderr, "The page size should be 4KB, 2MB or 1GB\n");
+        return -1;
+    }
+    tlb->page_bits = page_bits;
+    tlb->walks = 0;
+    for (int i = 0; i < tlb->nlevels; ++i) {
+        tlb_level_t* level = &tlb->levels[i];
+        geometry_t geometry = {__builtin_ctzl(level->entries / level->ways), level->ways, page_bits};
+        if (createCache(&level->cache, &geometry, NULL) < 0) return -1;
+    }
+    return 0;
+}
+
+void tlb_destroy(tlb_t* tlb) {
+    for (int i = 0; i < tlb->nlevels; ++i) destroyCache(&tlb->levels[i].cache);
+    tlb->nlevels = 0;
+}
+
+/**
+ * Put the translation of the page of addr into level, evicting the one
+ * the policy picks from a full set.
+ */
+static void tlb_fill(tlb_level_t* level, ull addr) {
+    cache_t* cache = &level->cache;
+    set_t* set = cache_set(cache, cache_set_index(cache, addr));
+    if (!set) return;
+    long line = find_a_empty_line(cache, set);
+    if (line < 0) {
+        level->evictions++;
+        line = evict(cache, set, NULL);
+    }
+    cache_fill(cache, set, line, cache_tag(cache, addr));
+}
+
+int tlb_access(tlb_t* tlb, ull addr, ull walk[WALK_LEVELS]) {
+    int hit = 0;
+    while (hit < tlb->nlevels) {
+        tlb_level_t* level = &tlb->levels[hit];
+        cache_t* cache = &level->cache;
+        set_t* set = cache_set(cache, cache_set_index(cache, addr));
+        long line = set ? cache_find(cache, set, cache_tag(cache, addr)) : -1;
+        if (line >= 0) {
+            level->hits++;
+            cache_touch(cache, set, line);
+            break;
+        }
+        level->misses++;
+        hit++;
+    }
+    for (int i = 0; i < hit; ++i) tlb_fill(&tlb->levels[i], addr);
+    if (hit < tlb->nlevels) return 0;
+
+    tlb->walks++;
+    ull va = addr & ((1ULL << VIRTUAL_BITS) - 1);
+    int n = 0;
+    for (int shift = WALK_ROOT_SHIFT; shift >= tlb->page_bits; shift -= WALK_LEVEL_BITS) {
+        walk[n] = PAGE_TABLE_BASE + n * PAGE_TABLE_STRIDE + (va >> shift) * PAGE_TABLE_ENTRY;
+        n++;
+    }
+    return n;
+}
+
+void tlb_report(const tlb_t* tlb, FILE* out) {
+    for (int i = 0; i < tlb->nlevels; ++i) {
+        const tlb_level_t* level = &tlb->levels[i];
+        fprintf(out, "TLB%d entries:%ld ways:%ld hits:%llu misses:%llu evictions:%llu\n", i + 1,
+            level->entries, level->ways, level->hits, level->misses, level->evictions);
+    }
+    fprintf(out, "page-walks:%llu page-size:%llu\n", tlb->walks, 1ULL << tlb->page_bits);
+}
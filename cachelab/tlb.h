@@ -0,0 +1,80 @@
+/*
+ * tlb.h - Translation lookaside buffers of the data accesses of the
+ * simulated cache and the page walks of their misses.
+ */
+
+#ifndef CSIM_TLB_H
+#define CSIM_TLB_H
+
+#include "cache.h"
+
+#define TLB_MAX_LEVELS 4
+#define PAGE_BITS 12 /**< 4KB pages by default */
+
+/**
+ * The page walk of an x86-64 4-level page table reads one 8-byte entry
+ * per level, from the root down: 4 entries for a 4KB page, 3 for a 2MB
+ * page and 2 for a 1GB page. The entries of a level are laid out as one
+ * flat array starting at PAGE_TABLE_BASE + level * PAGE_TABLE_STRIDE,
+ * indexed by the virtual address bits above the level, so neighbouring
+ * pages share the cache blocks of their entries like real page tables do.
+ */
+#define WALK_LEVELS 4
+#define WALK_ROOT_SHIFT 39
+#define WALK_LEVEL_BITS 9
+#define VIRTUAL_BITS 48
+#define PAGE_TABLE_ENTRY 8
+#define PAGE_TABLE_BASE (1ULL << 62)
+#define PAGE_TABLE_STRIDE (1ULL << 40)
+
+/**
+ * @brief one TLB level, a set associative cache of translations
+ */
+typedef struct {
+    long entries;
+    long ways;
+    cache_t cache; /**< a line per entry, a block per page */
+    ull hits;
+    ull misses;
+    ull evictions;
+} tlb_level_t;
+
+/**
+ * @brief the TLB levels of the data accesses, L1 first
+ *
+ * A miss in a level looks the page up in the next one, a miss in the last
+ * level walks the page table. The translation then fills every level that
+ * missed, the levels are neither inclusive nor exclusive.
+ */
+typedef struct {
+    tlb_level_t levels[TLB_MAX_LEVELS];
+    int nlevels;
+    int page_bits;
+    ull walks;
+} tlb_t;
+
+/**
+ * Append a level of entries translations in sets of ways to tlb, check
+ * that entries / ways is a power of two.
+ */
+int tlb_add_level(tlb_t* tlb, long entries, long ways);
+
+/**
+ * Set up the levels of tlb for pages of 1 << page_bits bytes, 4KB, 2MB or
+ * 1GB.
+ */
+int tlb_create(tlb_t* tlb, int page_bits);
+void tlb_destroy(tlb_t* tlb);
+
+/**
+ * Translate addr. Return 0 on a hit in one of the levels, otherwise the
+ * number of page table entries the walk reads, their addresses in walk.
+ */
+int tlb_access(tlb_t* tlb, ull addr, ull walk[WALK_LEVELS]);
+
+/**
+ * Print the hits, misses and evictions of every level and the page walks.
+ */
+void tlb_report(const tlb_t* tlb, FILE* out);
+
+#endif /* CSIM_TLB_H */
@@ -0,0 +1,758 @@
+/*
+ * trace.c - Reading valgrind (lackey) memory traces.
+ */
+#define _GNU_SOURCE
+#include "trace.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+typedef char trace_record_size_check[sizeof(trace_record_t) == TRACE_RECORD_SIZE ? 1 : -1];
+typedef char trace_header_size_check[sizeof(trace_header_t) == 24 ? 1 : -1];
+
+trace_t parse_trace(char* buf) {
+    trace_t trace = {0, 0, 0};
+    char* addr_end;
+    if (buf[0] == 'I') {
+        trace.op = 'I';
+        trace.addr = strtol(buf + 2, &addr_end, 16);
+        trace.size = strtol(addr_end + 1, NULL, 10);
+        return trace;
+    }
+    if (buf[1] != 'M' && buf[1] != 'L' && buf[1] != 'S') return trace;
+    trace.op = buf[1];
+    trace.addr = strtol(buf + 3, &addr_end, 16);
+    trace.size = strtol(addr_end + 1, NULL, 10);
+    return trace;
+}
+
+/**
+ * Scan a hexadecimal number at p, stop at the first non hex digit or at end.
+ */
+static inline const char* scan_hex(const char* p, const char* end, ull* out) {
+    ull v = 0;
+    for (; p < end; ++p) {
+        unsigned c = (unsigned char)*p;
+        unsigned d = c - '0';
+        if (d > 9) {
+            d = (c | 0x20) - 'a';
+            if (d > 5) break;
+            d += 10;
+        }
+        v = (v << 4) | d;
+    }
+    *out = v;
+    return p;
+}
+
+/**
+ * Scan a decimal number at p, stop at the first non digit or at end.
+ */
+static inline const char* scan_dec(const char* p, const char* end, int* out) {
+    int v = 0;
+    for (; p < end; ++p) {
+        unsigned d = (unsigned char)*p - '0';
+        if (d > 9) break;
+        v = v * 10 + d;
+    }
+    *out = v;
+    return p;
+}
+
+const char* scan_trace(const char* p, const char* end, trace_t* trace) {
+    const char* eol = memchr(p, '\n', end - p);
+    eol = eol ? eol + 1 : end;
+
+    trace->op = 0;
+    if (eol - p < 4) return eol;
+    if (p[0] == 'I') {
+        trace->op = 'I';
+        p += 2;
+    } else if (p[1] == 'M' || p[1] == 'L' || p[1] == 'S') {
+        trace->op = p[1];
+        p += 3;
+    } else {
+        return eol;
+    }
+    // lackey pads instruction addresses with an extra space
+    while (p < eol && *p == ' ') ++p;
+    p = scan_hex(p, eol, &trace->addr);
+    scan_dec(p + 1, eol, &trace->size);
+    return eol;
+}
+
+size_t trace_decode_scalar(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next) {
+    size_t n = 0;
+    while (p < end && n < max) {
+        p = scan_trace(p, end, &out[n]);
+        n += out[n].op != 0;
+    }
+    *next = p;
+    return n;
+}
+
+#ifdef __x86_64__
+
+/**
+ * Bytes the SIMD decoders need past the start of a line: a window of 32
+ * for the line and 16 for the address digits that start inside it.
+ */
+#define DECODE_AHEAD 48
+
+/**
+ * Convert the hex digits of a line: the 16 bytes at digits hold len
+ * (1..16) valid digits followed by anything. The digits are turned into
+ * nibbles, moved to the end of the vector so the number is right aligned,
+ * paired into bytes and the bytes swapped into a little endian integer.
+ */
+__attribute__((target("sse4.2")))
+static inline ull decode_hex(const char* digits, int len) {
+    __m128i c = _mm_loadu_si128((const __m128i*)digits);
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_cmpgt_epi8(c, _mm_set1_epi8('9'));
+    __m128i nibbles = _mm_blendv_epi8(_mm_sub_epi8(c, _mm_set1_epi8('0')),
+        _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)), letter);
+    // index i takes byte i - (16 - len), negative indexes give 0
+    __m128i index = _mm_add_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+        _mm_set1_epi8(len - 16));
+    nibbles = _mm_shuffle_epi8(nibbles, index);
+    __m128i bytes = _mm_maddubs_epi16(nibbles, _mm_set1_epi16(0x0110));
+    bytes = _mm_packus_epi16(bytes, bytes);
+    return __builtin_bswap64(_mm_cvtsi128_si64(bytes));
+}
+
+/**
+ * Decode the lines that end inside the 32 byte window at p from its
+ * masks of newlines, commas, spaces and hex digits. A line the fast path
+ * does not fully understand goes through scan_trace, which defines the
+ * format. Return the offset of the first line not decoded.
+ */
+__attribute__((target("sse4.2")))
+static inline unsigned decode_window(const char* p, const char* end, uint32_t nl, uint32_t comma,
+    uint32_t space, uint32_t hex, trace_t* out, size_t max, size_t* n) {
+    unsigned off = 0;
+    for (; nl && *n < max; nl &= nl - 1) {
+        unsigned eol = __builtin_ctz(nl);
+        trace_t* t = &out[*n];
+        t->op = 0;
+        unsigned start = 0;
+        if (eol - off >= 3) {
+            if (p[off] == 'I') {
+                t->op = 'I';
+                start = off + 2;
+            } else if (p[off + 1] == 'M' || p[off + 1] == 'L' || p[off + 1] == 'S') {
+                t->op = p[off + 1];
+                start = off + 3;
+            }
+        }
+        if (t->op) {
+            // the address runs from the first non space to the comma
+            uint32_t from = ~0U << start;
+            uint32_t digits = ~space & from;
+            start = digits ? __builtin_ctz(digits) : eol;
+            uint32_t stop = ~hex & (~0U << start);
+            unsigned at = stop ? __builtin_ctz(stop) : 32;
+            unsigned len = at - start;
+            if (at < eol && ((comma >> at) & 1) && len >= 1 && len <= 16) {
+                t->addr = decode_hex(p + start, len);
+                int size = 0;
+                for (const char* d = p + at + 1; d < p + eol; ++d) {
+                    unsigned v = (unsigned char)*d - '0';
+                    if (v > 9) break;
+                    size = size * 10 + v;
+                }
+                t->size = size;
+            } else {
+                scan_trace(p + off, end, t);
+            }
+        }
+        *n += t->op != 0;
+        off = eol + 1;
+    }
+    return off;
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t hex_mask16(__m128i c) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+        _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+        _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    return _mm_movemask_epi8(_mm_or_si128(digit, letter));
+}
+
+__attribute__((target("sse4.2")))
+size_t trace_decode_sse42(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next) {
+    size_t n = 0;
+    while (n < max && end - p >= DECODE_AHEAD) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+#define MASK32(x) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_set1_epi8(x))) \
+    | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, _mm_set1_epi8(x))) << 16)
+        uint32_t nl = MASK32('\n');
+        if (!nl) {
+            // longer than the window, not a record of lackey
+            const char* line = p;
+            p = scan_trace(p, end, &out[n]);
+            n += out[n].op != 0;
+            if (p == line) break;
+            continue;
+        }
+        uint32_t hex = hex_mask16(a) | hex_mask16(b) << 16;
+        p += decode_window(p, end, nl, MASK32(','), MASK32(' '), hex, out, max, &n);
+#undef MASK32
+    }
+    const char* rest;
+    n += trace_decode_scalar(p, end, out + n, max - n, &rest);
+    *next = rest;
+    return n;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t hex_mask32(__m256i c) {
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    return _mm256_movemask_epi8(_mm256_or_si256(digit, letter));
+}
+
+__attribute__((target("avx2")))
+size_t trace_decode_avx2(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next) {
+    size_t n = 0;
+    while (n < max && end - p >= DECODE_AHEAD) {
+        __m256i w = _mm256_loadu_si256((const __m256i*)p);
+#define MASK32(x) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(w, _mm256_set1_epi8(x))))
+        uint32_t nl = MASK32('\n');
+        if (!nl) {
+            const char* line = p;
+            p = scan_trace(p, end, &out[n]);
+            n += out[n].op != 0;
+            if (p == line) break;
+            continue;
+        }
+        p += decode_window(p, end, nl, MASK32(','), MASK32(' '), hex_mask32(w), out, max, &n);
+#undef MASK32
+    }
+    const char* rest;
+    n += trace_decode_scalar(p, end, out + n, max - n, &rest);
+    *next = rest;
+    return n;
+}
+
+trace_decode_fn trace_decoder(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return trace_decode_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return trace_decode_sse42;
+    return trace_decode_scalar;
+}
+
+#else
+
+size_t trace_decode_sse42(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next) {
+    return trace_decode_scalar(p, end, out, max, next);
+}
+
+size_t trace_decode_avx2(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next) {
+    return trace_decode_scalar(p, end, out, max, next);
+}
+
+trace_decode_fn trace_decoder(void) {
+    return trace_decode_scalar;
+}
+
+#endif
+
+/**
+ * Map a regular file, return -1 for pipes and anything else mmap refuses.
+ */
+static int map_file(trace_reader_t* reader) {
+    struct stat st;
+    int fd = fileno(reader->file);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return -1;
+
+    size_t len = st.st_size;
+    char* map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return -1;
+    madvise(map, len, MADV_SEQUENTIAL);
+    reader->map = map;
+    reader->map_len = len;
+    reader->pos = map;
+    reader->end = map + len;
+    return 0;
+}
+
+static int check_header(const trace_header_t* header) {
+    if (header->version != TRACE_VERSION || header->record_size != TRACE_RECORD_SIZE) {
+        fprintf(stderr, "unsupported binary trace version %u (record size %u)\n",
+            header->version, header->record_size);
+        return -1;
+    }
+    return 0;
+}
+
+int trace_open(trace_reader_t* reader, FILE* file, bool use_mmap) {
+    if (!reader || !file) return -1;
+    reader->file = file;
+    reader->format = TRACE_TEXT;
+    reader->map = NULL;
+    reader->map_len = 0;
+    reader->pos = reader->end = NULL;
+    reader->pipeline = NULL;
+    reader->parallel = NULL;
+    reader->decode = trace_decoder();
+    reader->text = NULL;
+    reader->text_pos = reader->text_len = 0;
+    reader->text_eof = false;
+    reader->error = false;
+
+    if (use_mmap && map_file(reader) == 0) {
+        if (reader->map_len < sizeof(trace_header_t)
+            || memcmp(reader->map, TRACE_MAGIC, 8) != 0) return 0;
+        const trace_header_t* header = (const trace_header_t*)reader->map;
+        if (check_header(header) < 0) {
+            trace_close(reader);
+            return -1;
+        }
+        reader->format = TRACE_BINARY;
+        reader->pos += sizeof(trace_header_t);
+        size_t avail = (reader->end - reader->pos) / TRACE_RECORD_SIZE;
+        if (header->count && header->count < avail) avail = header->count;
+        reader->end = reader->pos + avail * TRACE_RECORD_SIZE;
+        return 0;
+    }
+
+    // Only one byte of push back is guaranteed, that is enough to tell the formats apart.
+    int c = getc(file);
+    if (c != EOF) ungetc(c, file);
+    if (c != (unsigned char)TRACE_MAGIC[0]) {
+        reader->text = malloc(TRACE_TEXT_BUF);
+        if (!reader->text) {
+            fprintf(stderr, "allocate trace buffer failed: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "invalid binary trace header\n");
+        return -1;
+    }
+    if (check_header(&header) < 0) return -1;
+    reader->format = TRACE_BINARY;
+    return 0;
+}
+
+static void decode_records(const trace_record_t* in, size_t n, trace_t* out) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i].addr = in[i].addr;
+        out[i].op = in[i].op;
+        out[i].size = in[i].size;
+    }
+}
+
+/**
+ * Read the next TRACE_BATCH records at most into batch, anything but a
+ * mapped binary trace.
+ */
+static size_t read_batch(trace_reader_t* reader, trace_t* batch) {
+    size_t n = 0;
+    if (reader->format == TRACE_BINARY) {
+        trace_record_t raw[TRACE_BATCH];
+        n = fread(raw, TRACE_RECORD_SIZE, TRACE_BATCH, reader->file);
+        if (n < TRACE_BATCH && ferror(reader->file)) {
+            fprintf(stderr, "read trace failed: %s\n", strerror(errno));
+            reader->error = true;
+        }
+        decode_records(raw, n, batch);
+        return n;
+    }
+    if (reader->map) {
+        return reader->decode(reader->pos, reader->end, batch, TRACE_BATCH, &reader->pos);
+    }
+
+    // decode the complete lines in the buffer, then refill it behind the
+    // partial line left over; at the end of the file the last line needs
+    // no newline, and a buffer without any is decoded as one line
+    while (n < TRACE_BATCH) {
+        const char* p = reader->text + reader->text_pos;
+        const char* end = reader->text + reader->text_len;
+        const char* last = end > p ? memrchr(p, '\n', end - p) : NULL;
+        bool full = reader->text_pos == 0 && reader->text_len == TRACE_TEXT_BUF;
+        const char* stop = reader->text_eof ? end : last ? last + 1 : full ? end : p;
+        const char* next;
+        n += reader->decode(p, stop, batch + n, TRACE_BATCH - n, &next);
+        reader->text_pos = next - reader->text;
+        if (next < stop || reader->text_eof) break;
+
+        size_t rest = reader->text_len - reader->text_pos;
+        memmove(reader->text, next, rest);
+        reader->text_pos = 0;
+        reader->text_len = rest;
+        size_t got = fread(reader->text + rest, 1, TRACE_TEXT_BUF - rest, reader->file);
+        reader->text_len += got;
+        reader->text_eof = got == 0;
+        if (got == 0 && ferror(reader->file)) {
+            fprintf(stderr, "read trace failed: %s\n", strerror(errno));
+            reader->error = true;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief single producer, single consumer ring of parsed batches
+ *
+ * The parser owns the slots from tail + TRACE_RING up to head, the
+ * consumer the ones from tail to head. Each side only writes its own
+ * counter, with release stores the other side reads with acquire loads.
+ */
+typedef struct {
+    trace_t recs[TRACE_BATCH];
+    size_t n; /**< 0 marks the end of the trace */
+} trace_slot_t;
+
+struct trace_pipeline {
+    trace_slot_t slots[TRACE_RING];
+    ull head; /**< batches published by the parser */
+    ull tail; /**< batches the consumer is done with */
+    bool held; /**< the consumer still uses the batch in slot tail */
+    bool stop; /**< trace_close before the end of the trace */
+    pthread_t thread;
+};
+
+/**
+ * Wait for the other side of the ring, spinning a little first: handing
+ * over a batch is much faster than a trip through the scheduler.
+ */
+static inline void ring_wait(unsigned* spins) {
+    if (++*spins < 256) {
+        __builtin_ia32_pause();
+    } else {
+        sched_yield();
+    }
+}
+
+static void* pipeline_thread(void* arg) {
+    trace_reader_t* reader = arg;
+    trace_pipeline_t* pl = reader->pipeline;
+    for (ull head = 0;; ++head) {
+        unsigned spins = 0;
+        while (head - __atomic_load_n(&pl->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+            if (__atomic_load_n(&pl->stop, __ATOMIC_RELAXED)) return NULL;
+            ring_wait(&spins);
+        }
+        if (__atomic_load_n(&pl->stop, __ATOMIC_RELAXED)) return NULL;
+        trace_slot_t* slot = &pl->slots[head % TRACE_RING];
+        slot->n = read_batch(reader, slot->recs);
+        __atomic_store_n(&pl->head, head + 1, __ATOMIC_RELEASE);
+        if (slot->n == 0) return NULL;
+    }
+}
+
+static size_t pipeline_next(trace_pipeline_t* pl, const trace_t** recs) {
+    ull tail = pl->tail;
+    if (pl->held) {
+        __atomic_store_n(&pl->tail, ++tail, __ATOMIC_RELEASE);
+        pl->held = false;
+    }
+    unsigned spins = 0;
+    while (__atomic_load_n(&pl->head, __ATOMIC_ACQUIRE) == tail) ring_wait(&spins);
+    const trace_slot_t* slot = &pl->slots[tail % TRACE_RING];
+    // the end stays in the ring, later calls find it again
+    if (slot->n == 0) return 0;
+    pl->held = true;
+    *recs = slot->recs;
+    return slot->n;
+}
+
+int trace_pipeline(trace_reader_t* reader) {
+    if (!reader || reader->parallel || (reader->format == TRACE_BINARY && reader->map)) return 0;
+    trace_pipeline_t* pl = calloc(1, sizeof(trace_pipeline_t));
+    if (!pl) {
+        fprintf(stderr, "allocate trace pipeline failed: %s\n", strerror(errno));
+        return -1;
+    }
+    reader->pipeline = pl;
+    int err = pthread_create(&pl->thread, NULL, pipeline_thread, reader);
+    if (err) {
+        fprintf(stderr, "start trace parser failed: %s\n", strerror(err));
+        reader->pipeline = NULL;
+        free(pl);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief the records of one chunk of a parallel round
+ */
+typedef struct {
+    const char* begin;
+    const char* end;
+    trace_t* recs; /**< room for a record per shortest possible line */
+    size_t cap;
+    size_t n;
+} trace_chunk_t;
+
+/**
+ * Rounds alternate between two sets of chunks: the workers parse round
+ * next while trace_next hands out round current. The lock only guards
+ * the round counters, the chunks are handed over with them.
+ */
+struct trace_parallel {
+    int jobs;
+    pthread_t* threads;
+    trace_chunk_t* chunks[2]; /**< jobs chunks of the even and of the odd rounds */
+    pthread_mutex_t lock;
+    pthread_cond_t assigned_cond;
+    pthread_cond_t done_cond;
+    ull assigned; /**< rounds split into chunks */
+    int done[2]; /**< chunks of the round in chunks[i] parsed so far */
+    bool stop;
+    ull current; /**< round trace_next is in */
+    int chunk; /**< next chunk of current to hand out */
+};
+
+/**
+ * The shortest line scan_trace takes for a record, "I 0\n", bounds the
+ * records of a chunk.
+ */
+#define TRACE_MIN_LINE 4
+
+typedef struct {
+    trace_reader_t* reader;
+    int id;
+} parallel_worker_t;
+
+static void* parallel_thread(void* arg) {
+    parallel_worker_t* w = arg;
+    trace_parallel_t* pp = w->reader->parallel;
+    for (ull round = 0;; ++round) {
+        pthread_mutex_lock(&pp->lock);
+        while (pp->assigned <= round && !pp->stop) pthread_cond_wait(&pp->assigned_cond, &pp->lock);
+        bool stop = pp->stop;
+        pthread_mutex_unlock(&pp->lock);
+        if (stop) break;
+
+        trace_chunk_t* c = &pp->chunks[round % 2][w->id];
+        const char* p;
+        c->n = w->reader->decode(c->begin, c->end, c->recs, c->cap, &p);
+
+        pthread_mutex_lock(&pp->lock);
+        pp->done[round % 2]++;
+        pthread_cond_signal(&pp->done_cond);
+        pthread_mutex_unlock(&pp->lock);
+    }
+    free(w);
+    return NULL;
+}
+
+/**
+ * Split the next bytes of the trace into the chunks of a new round and
+ * wake up the workers, an exhausted trace makes a round of empty chunks.
+ */
+static int assign_round(trace_reader_t* reader) {
+    trace_parallel_t* pp = reader->parallel;
+    trace_chunk_t* chunks = pp->chunks[pp->assigned % 2];
+    const char* p = reader->pos;
+    for (int j = 0; j < pp->jobs; ++j) {
+        const char* e = reader->end - p > TRACE_CHUNK ? p + TRACE_CHUNK : reader->end;
+        if (e < reader->end) {
+            const char* nl = memchr(e, '\n', reader->end - e);
+            e = nl ? nl + 1 : reader->end;
+        }
+        size_t cap = (e - p) / TRACE_MIN_LINE + 1;
+        if (cap > chunks[j].cap) {
+            trace_t* recs = realloc(chunks[j].recs, cap * sizeof(trace_t));
+            if (!recs) {
+                fprintf(stderr, "allocate trace chunk failed: %s\n", strerror(errno));
+                return -1;
+            }
+            chunks[j].recs = recs;
+            chunks[j].cap = cap;
+        }
+        chunks[j].begin = p;
+        chunks[j].end = e;
+        p = e;
+    }
+    reader->pos = p;
+    pthread_mutex_lock(&pp->lock);
+    pp->done[pp->assigned % 2] = 0;
+    pp->assigned++;
+    pthread_cond_broadcast(&pp->assigned_cond);
+    pthread_mutex_unlock(&pp->lock);
+    return 0;
+}
+
+static size_t parallel_next(trace_reader_t* reader, const trace_t** recs) {
+    trace_parallel_t* pp = reader->parallel;
+    for (;;) {
+        if (pp->chunk == pp->jobs) {
+            // round current is used up, its chunks take the round after next
+            pp->current++;
+            pp->chunk = 0;
+            if (assign_round(reader) < 0) {
+                reader->error = true;
+                return 0;
+            }
+        }
+        pthread_mutex_lock(&pp->lock);
+        while (pp->done[pp->current % 2] < pp->jobs) pthread_cond_wait(&pp->done_cond, &pp->lock);
+        pthread_mutex_unlock(&pp->lock);
+
+        trace_chunk_t* c = &pp->chunks[pp->current % 2][pp->chunk];
+        if (c->begin == c->end) return 0;
+        pp->chunk++;
+        if (c->n > 0) {
+            *recs = c->recs;
+            return c->n;
+        }
+    }
+}
+
+static void parallel_stop(trace_parallel_t* pp) {
+    pthread_mutex_lock(&pp->lock);
+    pp->stop = true;
+    pthread_cond_broadcast(&pp->assigned_cond);
+    pthread_mutex_unlock(&pp->lock);
+    for (int j = 0; j < pp->jobs; ++j) {
+        if (pp->threads[j]) pthread_join(pp->threads[j], NULL);
+    }
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < pp->jobs; ++j) free(pp->chunks[i][j].recs);
+        free(pp->chunks[i]);
+    }
+    pthread_mutex_destroy(&pp->lock);
+    pthread_cond_destroy(&pp->assigned_cond);
+    pthread_cond_destroy(&pp->done_cond);
+    free(pp->threads);
+    free(pp);
+}
+
+int trace_parallel(trace_reader_t* reader, int jobs) {
+    if (!reader || jobs < 1 || reader->format != TRACE_TEXT || !reader->map) return 0;
+    trace_parallel_t* pp = calloc(1, sizeof(trace_parallel_t));
+    bool ok = pp && (pp->threads = calloc(jobs, sizeof(pthread_t)))
+        && (pp->chunks[0] = calloc(jobs, sizeof(trace_chunk_t)))
+        && (pp->chunks[1] = calloc(jobs, sizeof(trace_chunk_t)));
+    if (!ok) {
+        fprintf(stderr, "allocate trace chunks failed: %s\n", strerror(errno));
+        if (pp) {
+            free(pp->chunks[0]);
+            free(pp->threads);
+        }
+        free(pp);
+        return -1;
+    }
+    pp->jobs = jobs;
+    pthread_mutex_init(&pp->lock, NULL);
+    pthread_cond_init(&pp->assigned_cond, NULL);
+    pthread_cond_init(&pp->done_cond, NULL);
+    reader->parallel = pp;
+    for (int j = 0; j < jobs; ++j) {
+        parallel_worker_t* w = malloc(sizeof(parallel_worker_t));
+        int err = w ? 0 : ENOMEM;
+        if (w) {
+            *w = (parallel_worker_t){reader, j};
+            err = pthread_create(&pp->threads[j], NULL, parallel_thread, w);
+        }
+        if (err) {
+            fprintf(stderr, "start trace parser failed: %s\n", strerror(err));
+            free(w);
+            trace_close(reader);
+            return -1;
+        }
+    }
+    // the workers start on the first two rounds right away
+    if (assign_round(reader) < 0 || assign_round(reader) < 0) {
+        trace_close(reader);
+        return -1;
+    }
+    return 0;
+}
+
+size_t trace_next(trace_reader_t* reader, const trace_t** recs) {
+    if (reader->format == TRACE_BINARY && reader->map) {
+        size_t n = (reader->end - reader->pos) / TRACE_RECORD_SIZE;
+        if (n > TRACE_BATCH) n = TRACE_BATCH;
+        decode_records((const trace_record_t*)reader->pos, n, reader->batch);
+        *recs = reader->batch;
+        reader->pos += n * TRACE_RECORD_SIZE;
+        return n;
+    }
+    if (reader->parallel) return parallel_next(reader, recs);
+    if (reader->pipeline) return pipeline_next(reader->pipeline, recs);
+    *recs = reader->batch;
+    return read_batch(reader, reader->batch);
+}
+
+void trace_close(trace_reader_t* reader) {
+    if (!reader) return;
+    if (reader->parallel) {
+        parallel_stop(reader->parallel);
+        reader->parallel = NULL;
+    }
+    if (reader->pipeline) {
+        __atomic_store_n(&reader->pipeline->stop, true, __ATOMIC_RELAXED);
+        pthread_join(reader->pipeline->thread, NULL);
+        free(reader->pipeline);
+        reader->pipeline = NULL;
+    }
+    free(reader->text);
+    reader->text = NULL;
+    if (!reader->map) return;
+    munmap(reader->map, reader->map_len);
+    reader->map = NULL;
+}
+
+int trace_write_header(FILE* file, uint64_t count) {
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, 8);
+    header.version = TRACE_VERSION;
+    header.record_size = TRACE_RECORD_SIZE;
+    header.count = count;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "write trace header failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int trace_write_records(FILE* file, const trace_t* recs, size_t n) {
+    trace_record_t raw[TRACE_BATCH];
+    while (n > 0) {
+        size_t m = n < TRACE_BATCH ? n : TRACE_BATCH;
+        for (size_t i = 0; i < m; ++i) {
+            if (recs[i].size < 0 || recs[i].size > TRACE_MAX_SIZE) {
+                fprintf(stderr, "access size %d does not fit a binary trace record\n", recs[i].size);
+                return -1;
+            }
+            raw[i] = (trace_record_t){recs[i].addr, recs[i].op, recs[i].size};
+        }
+        if (fwrite(raw, TRACE_RECORD_SIZE, m, file) != m) {
+            fprintf(stderr, "write trace records failed: %s\n", strerror(errno));
+            return -1;
+        }
+        recs += m;
+        n -= m;
+    }
+    return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * trace.h - Reading valgrind (lackey) memory traces, in text or in the
+ * packed binary format produced by trace2bin.
+ */
+
+#ifndef CSIM_TRACE_H
+#define CSIM_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MAX_LEN 100
+#define TRACE_BATCH 4096
+#define TRACE_RING 32
+#define TRACE_CHUNK (1 << 20)
+#define TRACE_TEXT_BUF (1 << 16)
+
+typedef unsigned long long ull;
+
+/**
+ * One trace record.
+ */
+typedef struct {
+    ull addr;
+    int op; /**< 'I', 'L', 'S', 'M', or 0 for a line that is not a record */
+    int size;
+} trace_t;
+
+/**
+ * Binary trace header, followed by count records of record_size bytes.
+ * The magic starts with a non ASCII byte so it never looks like a text trace.
+ */
+#define TRACE_MAGIC "\x89TRACE\r\n"
+#define TRACE_VERSION 2
+
+/**
+ * On-disk record of the binary format, little endian and without padding
+ * whatever the compiler does with trace_t. Sizes above TRACE_MAX_SIZE
+ * cannot be stored.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t addr;
+    uint8_t op;
+    uint8_t size;
+} trace_record_t;
+
+#define TRACE_RECORD_SIZE 10
+#define TRACE_MAX_SIZE 255
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+} trace_header_t;
+
+typedef enum {
+    TRACE_TEXT,
+    TRACE_BINARY,
+} trace_format_t;
+
+/**
+ * Line decoders: parse the lines in [p, end) into at most max records,
+ * dropping lines which are not records, and set *next to the first line
+ * not parsed. Return the number of records. The SIMD ones find the line
+ * ends, commas and digits of 32 bytes at once and convert the address
+ * with vector arithmetic, they give the same records as scan_trace.
+ * trace_decoder picks the fastest one the CPU supports, all of them are
+ * exposed for benchmarking.
+ */
+typedef size_t (*trace_decode_fn)(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next);
+
+size_t trace_decode_scalar(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next);
+size_t trace_decode_sse42(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next);
+size_t trace_decode_avx2(const char* p, const char* end, trace_t* out, size_t max,
+    const char** next);
+trace_decode_fn trace_decoder(void);
+
+typedef struct trace_pipeline trace_pipeline_t;
+typedef struct trace_parallel trace_parallel_t;
+
+/**
+ * A trace being read batch by batch, see trace_next.
+ */
+typedef struct {
+    FILE* file;
+    trace_format_t format;
+    char* map; /**< the whole file when it could be mapped */
+    size_t map_len;
+    const char* pos;
+    const char* end;
+    trace_t batch[TRACE_BATCH];
+    trace_decode_fn decode;
+    char* text; /**< TRACE_TEXT_BUF bytes of a text trace read through stdio */
+    size_t text_pos;
+    size_t text_len;
+    bool text_eof;
+    trace_pipeline_t* pipeline; /**< the parser thread, NULL when trace_next parses */
+    trace_parallel_t* parallel; /**< the chunk parsers of a mapped text trace */
+    bool error; /**< reading stopped on an error, not at the end of the trace */
+} trace_reader_t;
+
+/**
+ * Parse a valgrind trace line.
+ *
+ * format:
+ * I 0400d7d4,8
+ *  M/L/S 0421c7f0,4
+ */
+trace_t parse_trace(char* buf);
+
+/**
+ * Parse the trace line starting at p in place, same rules as parse_trace.
+ * Return the start of the next line.
+ */
+const char* scan_trace(const char* p, const char* end, trace_t* trace);
+
+/**
+ * Detect the format of file and prepare to read it. Regular files are
+ * mapped unless use_mmap is false. Return 0 on success.
+ */
+int trace_open(trace_reader_t* reader, FILE* file, bool use_mmap);
+
+/**
+ * Point *recs at the next batch of records and return its length,
+ * 0 at the end of the trace or when reading failed, which sets error.
+ * Lines which are not records are dropped.
+ */
+size_t trace_next(trace_reader_t* reader, const trace_t** recs);
+
+/**
+ * Parse the rest of the trace in a thread of its own, which hands the
+ * batches over to trace_next through a ring of TRACE_RING batches, so the
+ * caller never waits on the input while parsed records are ready. Does
+ * nothing for a mapped binary trace, its records only need a copy.
+ */
+int trace_pipeline(trace_reader_t* reader);
+
+/**
+ * Parse a mapped text trace with jobs threads: each round splits the next
+ * jobs * TRACE_CHUNK bytes at line ends into jobs chunks parsed at the same
+ * time, while trace_next hands out the chunks of the round before in
+ * trace order. Does nothing for other traces.
+ */
+int trace_parallel(trace_reader_t* reader, int jobs);
+
+/**
+ * Release the mapping, stop the parser threads. The pipeline thread stops
+ * before its next read, so closing a live pipe early still waits for the
+ * read in progress to return.
+ */
+void trace_close(trace_reader_t* reader);
+
+/**
+ * Write a binary trace header for count records.
+ */
+int trace_write_header(FILE* file, uint64_t count);
+
+/**
+ * Write n records in the binary format, fail on a size above
+ * TRACE_MAX_SIZE.
+ */
+int trace_write_records(FILE* file, const trace_t* recs, size_t n);
+
+#endif /* CSIM_TRACE_H */
@@ -0,0 +1,91 @@
+/*
+ * trace2bin.c - Convert a valgrind (lackey) text trace to the packed
+ * binary format read by csim, or dump a binary trace back to text.
+ *
+ * usage: ./trace2bin [-d] <infile> <outfile>
+ *   "-" stands for stdin/stdout.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "trace.h"
+
+static void usage() {
+    printf("./trace2bin [-hd] <infile> <outfile>\n");
+    printf("  -d  dump a binary trace as text instead\n");
+}
+
+static FILE* open_file(const char* path, const char* mode, FILE* std) {
+    if (strcmp(path, "-") == 0) return std;
+    FILE* file = fopen(path, mode);
+    if (!file) {
+        fprintf(stderr, "open %s failed: %s\n", path, strerror(errno));
+    }
+    return file;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    int dump = 0;
+
+    while ((opt = getopt(argc, argv, "hd")) != -1) {
+        switch (opt) {
+            case 'd':
+                dump = 1;
+                break;
+            case 'h':
+            default:
+                usage();
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    FILE* in = open_file(argv[optind], "r", stdin);
+    FILE* out = open_file(argv[optind + 1], "w", stdout);
+    if (!in || !out) return 1;
+
+    trace_reader_t* reader = malloc(sizeof(trace_reader_t));
+    if (!reader || trace_open(reader, in, true) < 0) return 1;
+    if (dump != (reader->format == TRACE_BINARY)) {
+        fprintf(stderr, "%s is not a %s trace\n", argv[optind], dump ? "binary" : "text");
+        return 1;
+    }
+
+    // the record count is patched in at the end when the output is seekable
+    if (!dump && trace_write_header(out, 0) < 0) return 1;
+
+    const trace_t* recs;
+    size_t n;
+    uint64_t count = 0;
+    while ((n = trace_next(reader, &recs)) > 0) {
+        if (dump) {
+            for (size_t i = 0; i < n; ++i) {
+                if (recs[i].op == 'I') {
+                    fprintf(out, "I  %08llx,%d\n", recs[i].addr, recs[i].size);
+                } else {
+                    fprintf(out, " %c %08llx,%d\n", recs[i].op, recs[i].addr, recs[i].size);
+                }
+            }
+        } else if (trace_write_records(out, recs, n) < 0) {
+            return 1;
+        }
+        count += n;
+    }
+
+    if (reader->error) return 1;
+    if (!dump && fseek(out, 0, SEEK_SET) == 0 && trace_write_header(out, count) < 0) return 1;
+    trace_close(reader);
+    free(reader);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "close failed: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}